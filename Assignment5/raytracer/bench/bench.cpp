@@ -0,0 +1,294 @@
+#include <iostream>
+#include <cstring>
+#include <assert.h>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <string>
+#include "scene_parser.h"
+#include "camera.h"
+#include "rayTracer.h"
+#include "rayStats.h"
+#include "tileScheduler.h"
+
+using namespace std;
+
+// ====================================================================
+// ====================================================================
+// raytracer_bench: loads every scene*.txt of a directory once and
+// renders it with each acceleration structure and thread count,
+// reporting per-stage timings and ray counts as JSON or CSV.
+//
+//   raytracer_bench -dir ../cmake-build-debug -accel grid,bvh -threads 1,8
+
+/* used by the OpenGL preview in object3d.cpp, never drawn here */
+int thetaStep = 0;
+int phiStep = 0;
+bool gouraud = false;
+
+/* Arguments List */
+char *scene_dir = NULL;
+char *output_file = NULL;
+bool csv = false;
+
+int width = 128;
+int height = 128;
+
+// enough to exercise every kind of ray
+bool shadows = true;
+int max_bounces = 2;
+float cutoff_weight = 0.01;
+bool packets = false;
+
+int nx = 32;
+int ny = 32;
+int nz = 32;
+
+vector<string> accels = {"none", "grid", "bvh"};
+vector<int> thread_counts;
+
+struct Result {
+    string scene;
+    string accel;
+    int threads;
+    double parse_ms;
+    double build_ms;
+    double render_ms;
+    RayStats stats;
+};
+
+static double millisecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static vector<string> splitList(const char *list) {
+    vector<string> items;
+    string s(list);
+    size_t begin = 0;
+    while (begin <= s.size()) {
+        size_t end = s.find(',', begin);
+        if (end == string::npos) end = s.size();
+        if (end > begin) items.push_back(s.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return items;
+}
+
+void argParser(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-dir")) {
+            i++;
+            assert(i < argc);
+            scene_dir = argv[i];
+        } else if (!strcmp(argv[i], "-output")) {
+            i++;
+            assert(i < argc);
+            output_file = argv[i];
+        } else if (!strcmp(argv[i], "-csv")) {
+            csv = true;
+        } else if (!strcmp(argv[i], "-size")) {
+            i++;
+            assert(i < argc);
+            width = atoi(argv[i]);
+            i++;
+            assert(i < argc);
+            height = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-no_shadows")) {
+            shadows = false;
+        } else if (!strcmp(argv[i], "-bounces")) {
+            i++;
+            assert(i < argc);
+            max_bounces = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-weight")) {
+            i++;
+            assert(i < argc);
+            cutoff_weight = atof(argv[i]);
+        } else if (!strcmp(argv[i], "-packets")) {
+            packets = true;
+        } else if (!strcmp(argv[i], "-grid")) {
+            i++;
+            assert(i < argc);
+            if (!strcmp(argv[i], "auto")) {
+                nx = ny = nz = 0;
+                continue;
+            }
+            nx = atoi(argv[i]);
+            i++;
+            assert(i < argc);
+            ny = atoi(argv[i]);
+            i++;
+            assert(i < argc);
+            nz = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-accel")) {
+            i++;
+            assert(i < argc);
+            accels = splitList(argv[i]);
+            for (string &accel: accels) {
+                if (accel != "none" && accel != "grid" && accel != "bvh") {
+                    printf("whoops unknown acceleration structure '%s'\n", accel.c_str());
+                    assert(0);
+                }
+            }
+        } else if (!strcmp(argv[i], "-threads")) {
+            i++;
+            assert(i < argc);
+            thread_counts.clear();
+            for (string &count: splitList(argv[i])) {
+                int n = atoi(count.c_str());
+                thread_counts.push_back(n > 0 ? n : int(thread::hardware_concurrency()));
+            }
+        } else {
+            printf("whoops error with command line argument %d: '%s'\n", i, argv[i]);
+            assert(0);
+        }
+    }
+    assert(scene_dir != NULL);
+    if (thread_counts.empty()) {
+        thread_counts.push_back(1);
+        int hardware = thread::hardware_concurrency();
+        if (hardware > 1) thread_counts.push_back(hardware);
+    }
+}
+
+// the color pass of render() in main.cpp, without the output images
+static void renderScene(SceneParser *scene, RayTracer *rayTracer, int num_threads) {
+    Camera *camera = scene->getCamera();
+    TileScheduler scheduler(width, height);
+    scheduler.run(num_threads, [&](const TileScheduler::Tile &tile) {
+        if (packets) {
+            for (int j0 = tile.y0; j0 < tile.y1; j0 += PACKET_HEIGHT) {
+                for (int i0 = tile.x0; i0 < tile.x1; i0 += PACKET_WIDTH) {
+                    Vec2f points[SIMD_WIDTH];
+                    HitPacket hits;
+                    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                        int i = i0 + lane % PACKET_WIDTH;
+                        int j = j0 + lane / PACKET_WIDTH;
+                        points[lane] = Vec2f(float(i) / float(width), float(j) / float(height));
+                        if (i >= tile.x1 || j >= tile.y1) hits.disableLane(lane);
+                    }
+                    RayPacket packet;
+                    camera->generateRayPacket(points, packet);
+                    Vec3f colors[SIMD_WIDTH];
+                    rayTracer->tracePacket(packet, camera->getTMin(), hits, colors);
+                }
+            }
+        } else {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                for (int j = tile.y0; j < tile.y1; j++) {
+                    Ray ray = camera->generateRay(Vec2f(float(i) / float(width), float(j) / float(height)));
+                    Hit hit(INFINITY, nullptr, Vec3f(0.0, 0.0, 0.0));
+                    rayTracer->traceRay(ray, camera->getTMin(), 0, 1.0, 1.0, hit);
+                }
+            }
+        }
+        RayStats::flush();
+    });
+}
+
+static void writeResults(FILE *out, const vector<Result> &results) {
+    if (csv) {
+        fprintf(out, "scene,accel,threads,width,height,parse_ms,build_ms,render_ms,rays_per_sec,"
+                     "primary_rays,shadow_rays,secondary_rays,intersection_tests,tests_per_ray\n");
+    } else {
+        fprintf(out, "[\n");
+    }
+    for (size_t n = 0; n < results.size(); n++) {
+        const Result &r = results[n];
+        long long rays = r.stats.getRays();
+        double rays_per_sec = r.render_ms > 0 ? rays / (r.render_ms / 1000.0) : 0;
+        double tests_per_ray = rays > 0 ? double(r.stats.getIntersectionTests()) / rays : 0;
+        // without the counters the ray columns are unknown, not zero: null
+        // in JSON and empty in CSV
+        char ray_columns[6][32];
+        const char *unknown = csv ? "" : "null";
+        if (RAYTRACER_STATS) {
+            snprintf(ray_columns[0], 32, "%.0f", rays_per_sec);
+            snprintf(ray_columns[1], 32, "%lld", r.stats.primary_rays);
+            snprintf(ray_columns[2], 32, "%lld", r.stats.shadow_rays);
+            snprintf(ray_columns[3], 32, "%lld", r.stats.getSecondaryRays());
+            snprintf(ray_columns[4], 32, "%lld", r.stats.getIntersectionTests());
+            snprintf(ray_columns[5], 32, "%.3f", tests_per_ray);
+        } else {
+            for (char *column: ray_columns) {
+                snprintf(column, 32, "%s", unknown);
+            }
+        }
+        if (csv) {
+            fprintf(out, "%s,%s,%d,%d,%d,%.3f,%.3f,%.3f,%s,%s,%s,%s,%s,%s\n",
+                    r.scene.c_str(), r.accel.c_str(), r.threads, width, height,
+                    r.parse_ms, r.build_ms, r.render_ms, ray_columns[0],
+                    ray_columns[1], ray_columns[2], ray_columns[3],
+                    ray_columns[4], ray_columns[5]);
+        } else {
+            fprintf(out, "  {\"scene\": \"%s\", \"accel\": \"%s\", \"threads\": %d, \"width\": %d, \"height\": %d, "
+                         "\"parse_ms\": %.3f, \"build_ms\": %.3f, \"render_ms\": %.3f, \"rays_per_sec\": %s, "
+                         "\"primary_rays\": %s, \"shadow_rays\": %s, \"secondary_rays\": %s, "
+                         "\"intersection_tests\": %s, \"tests_per_ray\": %s}%s\n",
+                    r.scene.c_str(), r.accel.c_str(), r.threads, width, height,
+                    r.parse_ms, r.build_ms, r.render_ms, ray_columns[0],
+                    ray_columns[1], ray_columns[2], ray_columns[3],
+                    ray_columns[4], ray_columns[5], n + 1 < results.size() ? "," : "");
+        }
+    }
+    if (!csv) fprintf(out, "]\n");
+}
+
+int main(int argc, char **argv) {
+    argParser(argc, argv);
+    if (!RAYTRACER_STATS) {
+        fprintf(stderr, "raytracer_bench: rays are not counted, the ray columns stay empty; build with -DRAYTRACER_STATS=ON\n");
+    }
+
+    // the scenes name their .obj files relative to their own directory
+    filesystem::path output_path = output_file ? filesystem::absolute(output_file) : filesystem::path();
+    filesystem::current_path(scene_dir);
+    vector<string> scene_files;
+    for (const filesystem::directory_entry &entry: filesystem::directory_iterator(".")) {
+        string name = entry.path().filename().string();
+        if (name.compare(0, 5, "scene") == 0 && entry.path().extension() == ".txt") {
+            scene_files.push_back(name);
+        }
+    }
+    sort(scene_files.begin(), scene_files.end());
+
+    vector<Result> results;
+    for (string &name: scene_files) {
+        fprintf(stderr, "%s\n", name.c_str());
+        auto start = chrono::steady_clock::now();
+        SceneParser scene((char *) name.c_str());
+        double parse_ms = millisecondsSince(start);
+
+        for (string &accel: accels) {
+            start = chrono::steady_clock::now();
+            RayTracer rayTracer(&scene, max_bounces, cutoff_weight, shadows, false,
+                                accel == "grid", nx, ny, nz, false, accel == "bvh");
+            double build_ms = millisecondsSince(start);
+            if (rayTracer.getGrid() != NULL && nx == 0) {
+                Vec3f n = rayTracer.getGrid()->getGrid();
+                fprintf(stderr, "  grid auto: %dx%dx%d\n", int(n.x()), int(n.y()), int(n.z()));
+            }
+
+            for (int num_threads: thread_counts) {
+                RayStats::reset();
+                start = chrono::steady_clock::now();
+                renderScene(&scene, &rayTracer, num_threads);
+                double render_ms = millisecondsSince(start);
+
+                Result result = {name, accel, num_threads, parse_ms, build_ms, render_ms, RayStats::total()};
+                results.push_back(result);
+                fprintf(stderr, "  %-4s %2d threads %10.3f ms\n", accel.c_str(), num_threads, render_ms);
+            }
+        }
+    }
+
+    FILE *out = stdout;
+    if (output_file != NULL) {
+        out = fopen(output_path.string().c_str(), "w");
+        assert(out != NULL);
+    }
+    writeResults(out, results);
+    if (out != stdout) fclose(out);
+    return 0;
+}
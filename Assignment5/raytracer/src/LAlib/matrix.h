@@ -160,6 +160,28 @@ public:
         v.Set(v2.x(), v2.y(), v2.z());
     }
 
+    // true when the bottom row is (0 0 0 1), i.e. the matrix is
+    // a linear map plus a translation with no projective part
+    bool IsAffine() const {
+        return data[3][0] == 0 && data[3][1] == 0 && data[3][2] == 0 && data[3][3] == 1;
+    }
+
+    // Same as Transform / TransformDirection, but only valid for affine
+    // matrices: skips the bottom row and the homogeneous coordinate
+    void TransformAffine(Vec3f &v) const {
+        float x = v.x(), y = v.y(), z = v.z();
+        v.Set(data[0][0] * x + data[0][1] * y + data[0][2] * z + data[0][3],
+              data[1][0] * x + data[1][1] * y + data[1][2] * z + data[1][3],
+              data[2][0] * x + data[2][1] * y + data[2][2] * z + data[2][3]);
+    }
+
+    void TransformDirectionAffine(Vec3f &v) const {
+        float x = v.x(), y = v.y(), z = v.z();
+        v.Set(data[0][0] * x + data[0][1] * y + data[0][2] * z,
+              data[1][0] * x + data[1][1] * y + data[1][2] * z,
+              data[2][0] * x + data[2][1] * y + data[2][2] * z);
+    }
+
     // INPUT / OUTPUT
     void Write(FILE *F = stdout) const;
 
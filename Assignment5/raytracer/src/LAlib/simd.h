@@ -0,0 +1,179 @@
+#ifndef RAYTRACER_SIMD_H
+#define RAYTRACER_SIMD_H
+
+#include <math.h>
+
+// ====================================================================
+// ====================================================================
+// Thin wrapper over the widest float vector the compiler was told it
+// may use: 8 lanes with AVX2 (-mavx2), 4 lanes with SSE2, and a plain
+// 4-lane array as the fallback on other targets.  Only what the packet
+// kernels need is here.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 4
+#define SIMD_SCALAR
+#endif
+
+class SimdFloat {
+public:
+#if defined(__AVX2__)
+    typedef __m256 Native;
+#elif defined(__SSE2__)
+    typedef __m128 Native;
+#else
+    struct Native { float f[SIMD_WIDTH]; };
+#endif
+
+    SimdFloat() {}
+
+    SimdFloat(Native _v) : v(_v) {}
+
+    SimdFloat(float f) {
+#if defined(__AVX2__)
+        v = _mm256_set1_ps(f);
+#elif defined(__SSE2__)
+        v = _mm_set1_ps(f);
+#else
+        for (int i = 0; i < SIMD_WIDTH; i++) v.f[i] = f;
+#endif
+    }
+
+    static SimdFloat load(const float *p) {
+#if defined(__AVX2__)
+        return _mm256_loadu_ps(p);
+#elif defined(__SSE2__)
+        return _mm_loadu_ps(p);
+#else
+        SimdFloat r;
+        for (int i = 0; i < SIMD_WIDTH; i++) r.v.f[i] = p[i];
+        return r;
+#endif
+    }
+
+    void store(float *p) const {
+#if defined(__AVX2__)
+        _mm256_storeu_ps(p, v);
+#elif defined(__SSE2__)
+        _mm_storeu_ps(p, v);
+#else
+        for (int i = 0; i < SIMD_WIDTH; i++) p[i] = v.f[i];
+#endif
+    }
+
+    float operator[](int i) const {
+        float f[SIMD_WIDTH];
+        store(f);
+        return f[i];
+    }
+
+    Native v;
+};
+
+// comparison results: all bits of a lane set when true
+typedef SimdFloat SimdMask;
+
+#if defined(__AVX2__)
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a.v, b.v); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a.v, b.v); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a.v, b.v); }
+inline SimdFloat simdSqrt(SimdFloat a) { return _mm256_sqrt_ps(a.v); }
+inline SimdMask operator<(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline SimdMask operator>(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline SimdMask operator<=(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline SimdMask operator>=(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline SimdMask operator&(SimdMask a, SimdMask b) { return _mm256_and_ps(a.v, b.v); }
+inline SimdMask operator|(SimdMask a, SimdMask b) { return _mm256_or_ps(a.v, b.v); }
+// lane i of the result is mask ? a : b
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat a, SimdFloat b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+// bit i is set when lane i of the mask is true
+inline int simdBits(SimdMask mask) { return _mm256_movemask_ps(mask.v); }
+
+#elif defined(__SSE2__)
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm_add_ps(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm_div_ps(a.v, b.v); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm_min_ps(a.v, b.v); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm_max_ps(a.v, b.v); }
+inline SimdFloat simdSqrt(SimdFloat a) { return _mm_sqrt_ps(a.v); }
+inline SimdMask operator<(SimdFloat a, SimdFloat b) { return _mm_cmplt_ps(a.v, b.v); }
+inline SimdMask operator>(SimdFloat a, SimdFloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline SimdMask operator<=(SimdFloat a, SimdFloat b) { return _mm_cmple_ps(a.v, b.v); }
+inline SimdMask operator>=(SimdFloat a, SimdFloat b) { return _mm_cmpge_ps(a.v, b.v); }
+inline SimdMask operator&(SimdMask a, SimdMask b) { return _mm_and_ps(a.v, b.v); }
+inline SimdMask operator|(SimdMask a, SimdMask b) { return _mm_or_ps(a.v, b.v); }
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat a, SimdFloat b) {
+    return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+inline int simdBits(SimdMask mask) { return _mm_movemask_ps(mask.v); }
+
+#else
+
+#define SIMD_LANEWISE(expr) \
+    SimdFloat r; \
+    for (int i = 0; i < SIMD_WIDTH; i++) r.v.f[i] = (expr); \
+    return r;
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(a.v.f[i] + b.v.f[i]) }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(a.v.f[i] - b.v.f[i]) }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(a.v.f[i] * b.v.f[i]) }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(a.v.f[i] / b.v.f[i]) }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(a.v.f[i] < b.v.f[i] ? a.v.f[i] : b.v.f[i]) }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(a.v.f[i] > b.v.f[i] ? a.v.f[i] : b.v.f[i]) }
+inline SimdFloat simdSqrt(SimdFloat a) { SIMD_LANEWISE(sqrtf(a.v.f[i])) }
+// the fallback keeps masks as 0 / 1 per lane
+inline SimdMask operator<(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(a.v.f[i] < b.v.f[i] ? 1.0f : 0.0f) }
+inline SimdMask operator>(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(a.v.f[i] > b.v.f[i] ? 1.0f : 0.0f) }
+inline SimdMask operator<=(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(a.v.f[i] <= b.v.f[i] ? 1.0f : 0.0f) }
+inline SimdMask operator>=(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(a.v.f[i] >= b.v.f[i] ? 1.0f : 0.0f) }
+inline SimdMask operator&(SimdMask a, SimdMask b) { SIMD_LANEWISE(a.v.f[i] != 0 && b.v.f[i] != 0 ? 1.0f : 0.0f) }
+inline SimdMask operator|(SimdMask a, SimdMask b) { SIMD_LANEWISE(a.v.f[i] != 0 || b.v.f[i] != 0 ? 1.0f : 0.0f) }
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat a, SimdFloat b) { SIMD_LANEWISE(mask.v.f[i] != 0 ? a.v.f[i] : b.v.f[i]) }
+inline int simdBits(SimdMask mask) {
+    int bits = 0;
+    for (int i = 0; i < SIMD_WIDTH; i++) if (mask.v.f[i] != 0) bits |= 1 << i;
+    return bits;
+}
+
+#undef SIMD_LANEWISE
+
+#endif
+
+// ====================================================================
+// ====================================================================
+// three SimdFloats, one vector per lane
+
+class SimdVec3f {
+public:
+    SimdVec3f() {}
+
+    SimdVec3f(SimdFloat _x, SimdFloat _y, SimdFloat _z) : x(_x), y(_y), z(_z) {}
+
+    SimdFloat Dot3(const SimdVec3f &b) const { return x * b.x + y * b.y + z * b.z; }
+
+    static SimdVec3f Cross3(const SimdVec3f &a, const SimdVec3f &b) {
+        return SimdVec3f(a.y * b.z - a.z * b.y,
+                         a.z * b.x - a.x * b.z,
+                         a.x * b.y - a.y * b.x);
+    }
+
+    SimdFloat x, y, z;
+};
+
+inline SimdVec3f operator+(const SimdVec3f &a, const SimdVec3f &b) { return SimdVec3f(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline SimdVec3f operator-(const SimdVec3f &a, const SimdVec3f &b) { return SimdVec3f(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline SimdVec3f operator*(const SimdVec3f &a, SimdFloat f) { return SimdVec3f(a.x * f, a.y * f, a.z * f); }
+
+#endif //RAYTRACER_SIMD_H
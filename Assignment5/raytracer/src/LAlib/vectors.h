@@ -179,11 +179,8 @@ public:
     // CONSTRUCTORS & DESTRUCTOR
     Vec3f() { data[0] = data[1] = data[2] = 0; }
 
-    Vec3f(const Vec3f &V) {
-        data[0] = V.data[0];
-        data[1] = V.data[1];
-        data[2] = V.data[2];
-    }
+    // trivially copyable, arrays of them are saved and loaded as they are
+    Vec3f(const Vec3f &V) = default;
 
     Vec3f(float d0, float d1, float d2) {
         data[0] = d0;
@@ -197,7 +194,7 @@ public:
         data[2] = V1.data[2] - V2.data[2];
     }
 
-    ~Vec3f() {}
+    ~Vec3f() = default;
 
     // ACCESSORS
     void Get(float &d0, float &d1, float &d2) const {
@@ -280,12 +277,7 @@ public:
     }
 
     // OVERLOADED OPERATORS
-    Vec3f &operator=(const Vec3f &V) {
-        data[0] = V.data[0];
-        data[1] = V.data[1];
-        data[2] = V.data[2];
-        return *this;
-    }
+    Vec3f &operator=(const Vec3f &V) = default;
 
     int operator==(const Vec3f &V) {
         return ((data[0] == V.data[0]) &&
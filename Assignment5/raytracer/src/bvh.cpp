@@ -0,0 +1,364 @@
+#include "bvh.h"
+#include "rayStats.h"
+#include <algorithm>
+#include <string.h>
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF 8
+// cost of visiting a node, relative to one primitive intersection
+#define BVH_TRAVERSAL_COST 0.125f
+// the traversal stack holds at most one node per level plus one, so
+// nodes this deep become leaves however many primitives they hold
+#define BVH_STACK_SIZE 64
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 2)
+
+static float halfArea(const Vec3f &min, const Vec3f &max) {
+    Vec3f d = max - min;
+    return d.x() * d.y() + d.y() * d.z() + d.z() * d.x();
+}
+
+static void extend(Vec3f &min, Vec3f &max, const Vec3f &v) {
+    min = Vec3f(min2(min.x(), v.x()), min2(min.y(), v.y()), min2(min.z(), v.z()));
+    max = Vec3f(max2(max.x(), v.x()), max2(max.y(), v.y()), max2(max.z(), v.z()));
+}
+
+void BVHInstances::attach(Transform *transform, Object3D *object) {
+    if (bvhs.find(object) == bvhs.end()) {
+        BVH *bvh = new BVH(object, nullptr, this);
+        if (bvh->getNumPrimitives() <= 1) {
+            delete bvh;
+            bvh = nullptr;
+        }
+        bvhs[object] = bvh;
+    }
+    transform->setAccelerator(bvhs[object]);
+    transforms.push_back(transform);
+}
+
+BVHInstances::~BVHInstances() {
+    for (Transform *transform: transforms) {
+        transform->setAccelerator(nullptr);
+    }
+    for (auto &entry: bvhs) {
+        delete entry.second;
+    }
+}
+
+BVH::BVH(Object3D *_root, SceneCache *cache, BVHInstances *_instances) :
+        root(_root), instances(_instances), own_instances(_instances == nullptr) {
+    material = nullptr;
+    boundingBox = nullptr;
+    if (own_instances) instances = new BVHInstances();
+    root->insertIntoBVH(this);
+
+    if (!pending.empty()) {
+        const char *cached_nodes;
+        size_t node_bytes;
+        const int *order;
+        primitives.reserve(pending.size());
+        if (cache != nullptr && cache->getBVH(pending.size(), cached_nodes, node_bytes, order)) {
+            nodes.resize(node_bytes / sizeof(Node));
+            memcpy(nodes.data(), cached_nodes, node_bytes);
+            for (size_t i = 0; i < pending.size(); i++) {
+                primitives.push_back(pending[order[i]].primitive);
+            }
+        } else {
+            nodes.reserve(2 * pending.size());
+            build(pending, 0, pending.size(), 0);
+            // the boxes are a little larger than they are, like the grid
+            // cells, so rounding never drops a ray that grazes a primitive
+            Vec3f size = nodes[0].max - nodes[0].min;
+            float scale = max(max(size.x(), size.y()), size.z());
+            for (int a = 0; a < 3; a++) {
+                scale = max(scale, max(fabs(nodes[0].min[a]), fabs(nodes[0].max[a])));
+            }
+            Vec3f slack(1e-5f * scale, 1e-5f * scale, 1e-5f * scale);
+            for (Node &node: nodes) {
+                node.min -= slack;
+                node.max += slack;
+            }
+            vector<int> build_order;
+            for (BuildItem &item: pending) {
+                primitives.push_back(item.primitive);
+                build_order.push_back(item.index);
+            }
+            if (cache != nullptr) {
+                cache->setBVH(nodes.data(), nodes.size() * sizeof(Node), build_order.data(), build_order.size());
+            }
+        }
+        boundingBox = new BoundingBox(nodes[0].min, nodes[0].max);
+    }
+    pending.clear();
+    pending.shrink_to_fit();
+}
+
+void BVH::insertIntoThis(Object3D *obj) {
+    BoundingBox *bb = obj->getBoundingBox();
+    if (bb == nullptr) {
+        unbounded.push_back(obj);
+        return;
+    }
+    insertFace(obj, 0, bb);
+}
+
+void BVH::insertFace(Object3D *obj, int face, BoundingBox *bb) {
+    BuildItem item;
+    item.primitive = Primitive{obj, face};
+    item.index = pending.size();
+    item.min = bb->getMin();
+    item.max = bb->getMax();
+    item.centroid = 0.5f * (item.min + item.max);
+    pending.push_back(item);
+}
+
+bool BVH::checkNodes(const char *data, size_t node_bytes, int num_primitives) {
+    if (node_bytes == 0 || node_bytes % sizeof(Node) != 0 || node_bytes / sizeof(Node) > size_t(INT32_MAX)) return false;
+    int n = node_bytes / sizeof(Node);
+    // the children of a node come after it, so one pass in order sees
+    // every node's depth before the node itself
+    vector<int> depth(n, -1);
+    depth[0] = 0;
+    for (int i = 0; i < n; i++) {
+        Node node;
+        memcpy(&node, data + size_t(i) * sizeof(Node), sizeof(Node));
+        if (depth[i] < 0) return false;
+        if (node.count > 0) {
+            if (node.offset < 0 || node.offset > num_primitives - node.count) return false;
+            continue;
+        }
+        if (node.count < 0 || node.axis < 0 || node.axis > 2 || node.offset <= i + 1 || node.offset >= n ||
+            depth[i] >= BVH_MAX_DEPTH)
+            return false;
+        depth[i + 1] = depth[node.offset] = depth[i] + 1;
+    }
+    return true;
+}
+
+int BVH::build(vector<BuildItem> &items, int begin, int end, int depth) {
+    Node node;
+    node.min = Vec3f(INFINITY, INFINITY, INFINITY);
+    node.max = Vec3f(-INFINITY, -INFINITY, -INFINITY);
+    Vec3f cmin = node.min;
+    Vec3f cmax = node.max;
+    for (int i = begin; i < end; i++) {
+        extend(node.min, node.max, items[i].min);
+        extend(node.min, node.max, items[i].max);
+        extend(cmin, cmax, items[i].centroid);
+    }
+    node.offset = begin;
+    node.count = end - begin;
+    node.axis = 0;
+
+    int index = nodes.size();
+    nodes.push_back(node);
+    int n = end - begin;
+    if (n <= 2 || depth >= BVH_MAX_DEPTH) return index;
+
+    // binned SAH: sweep the bin boundaries of every axis and keep the
+    // cheapest split, cost = traversal + (A_l * N_l + A_r * N_r) / A
+    float bestCost = INFINITY;
+    int bestAxis = -1;
+    int bestBin = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = cmax[axis] - cmin[axis];
+        if (extent <= 0) continue;
+        int count[BVH_BINS] = {0};
+        Vec3f bmin[BVH_BINS], bmax[BVH_BINS];
+        for (int b = 0; b < BVH_BINS; b++) {
+            bmin[b] = Vec3f(INFINITY, INFINITY, INFINITY);
+            bmax[b] = Vec3f(-INFINITY, -INFINITY, -INFINITY);
+        }
+        for (int i = begin; i < end; i++) {
+            int b = int(BVH_BINS * (items[i].centroid[axis] - cmin[axis]) / extent);
+            if (b >= BVH_BINS) b = BVH_BINS - 1;
+            count[b]++;
+            extend(bmin[b], bmax[b], items[i].min);
+            extend(bmin[b], bmax[b], items[i].max);
+        }
+        // right-to-left prefix of areas and counts
+        float rightArea[BVH_BINS];
+        int rightCount[BVH_BINS];
+        Vec3f rmin(INFINITY, INFINITY, INFINITY), rmax(-INFINITY, -INFINITY, -INFINITY);
+        int rc = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--) {
+            rc += count[b];
+            if (count[b]) {
+                extend(rmin, rmax, bmin[b]);
+                extend(rmin, rmax, bmax[b]);
+            }
+            rightCount[b] = rc;
+            rightArea[b] = rc ? halfArea(rmin, rmax) : 0;
+        }
+        Vec3f lmin(INFINITY, INFINITY, INFINITY), lmax(-INFINITY, -INFINITY, -INFINITY);
+        int lc = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++) {
+            lc += count[b];
+            if (count[b]) {
+                extend(lmin, lmax, bmin[b]);
+                extend(lmin, lmax, bmax[b]);
+            }
+            if (lc == 0 || rightCount[b + 1] == 0) continue;
+            float cost = halfArea(lmin, lmax) * lc + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    int mid;
+    float parentArea = halfArea(node.min, node.max);
+    if (bestAxis >= 0) {
+        float splitCost = parentArea > 0 ? BVH_TRAVERSAL_COST + bestCost / parentArea : INFINITY;
+        if (splitCost >= n && n <= BVH_MAX_LEAF) return index;
+        float extent = cmax[bestAxis] - cmin[bestAxis];
+        BuildItem *split = std::partition(&items[begin], &items[begin] + n, [&](const BuildItem &item) {
+            int b = int(BVH_BINS * (item.centroid[bestAxis] - cmin[bestAxis]) / extent);
+            if (b >= BVH_BINS) b = BVH_BINS - 1;
+            return b <= bestBin;
+        });
+        mid = split - &items[0];
+    } else {
+        // all centroids coincide, the SAH can't separate them
+        if (n <= BVH_MAX_LEAF) return index;
+        mid = begin + n / 2;
+    }
+
+    nodes[index].count = 0;
+    nodes[index].axis = bestAxis >= 0 ? bestAxis : 0;
+    build(items, begin, mid, depth + 1);
+    int right = build(items, mid, end, depth + 1);
+    nodes[index].offset = right;
+    return index;
+}
+
+template<bool anyHit>
+bool BVH::traverse(const Ray &r, Hit &h, float tmin) const {
+    bool flag = false;
+    for (Object3D *obj: unbounded) {
+        if (anyHit) {
+            if (obj->intersectShadowRay(r, h, tmin)) return true;
+        } else if (obj->intersect(r, h, tmin)) {
+            flag = true;
+        }
+    }
+    if (nodes.empty()) return flag;
+    RAYSTAT(bvh_rays);
+
+    const Vec3f &ro = r.getOrigin();
+    const Vec3f &rd = r.getDirection();
+    float inv[3] = {1.0f / rd.x(), 1.0f / rd.y(), 1.0f / rd.z()};
+    bool negative[3] = {inv[0] < 0, inv[1] < 0, inv[2] < 0};
+
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node &node = nodes[stack[--top]];
+        RAYSTAT(bvh_nodes);
+
+        // slab test against [tmin, closest hit so far]
+        float t_near = tmin;
+        float t_far = h.getT();
+        for (int a = 0; a < 3; a++) {
+            float t0 = (node.min[a] - ro[a]) * inv[a];
+            float t1 = (node.max[a] - ro[a]) * inv[a];
+            if (negative[a]) swap(t0, t1);
+            t_near = t0 > t_near ? t0 : t_near;
+            t_far = t1 < t_far ? t1 : t_far;
+        }
+        if (t_near > t_far) continue;
+
+        if (node.count > 0) {
+            for (int i = node.offset; i < node.offset + node.count; i++) {
+                const Primitive &p = primitives[i];
+                if (anyHit) {
+                    if (p.object->intersectFaceShadowRay(p.face, r, h, tmin)) return true;
+                } else if (p.object->intersectFace(p.face, r, h, tmin)) {
+                    flag = true;
+                }
+            }
+        } else {
+            // visit the child nearer to the ray origin first
+            int first = &node - &nodes[0] + 1;
+            int second = node.offset;
+            if (negative[node.axis]) swap(first, second);
+            assert(top + 2 <= BVH_STACK_SIZE);
+            stack[top++] = second;
+            stack[top++] = first;
+        }
+    }
+    return flag;
+}
+
+bool BVH::intersect(const Ray &r, Hit &h, float tmin) const {
+    return traverse<false>(r, h, tmin);
+}
+
+bool BVH::intersectShadowRay(const Ray &r, Hit &h, float tmin) const {
+    return traverse<true>(r, h, tmin);
+}
+
+void BVH::intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const {
+    for (Object3D *obj: unbounded) {
+        obj->intersectPacket(r, h, tmin);
+    }
+    if (nodes.empty()) return;
+    RAYSTAT(bvh_rays);
+
+    const SimdVec3f &ro = r.getOrigin();
+    const SimdVec3f &rd = r.getDirection();
+    SimdVec3f inv(SimdFloat(1) / rd.x, SimdFloat(1) / rd.y, SimdFloat(1) / rd.z);
+    SimdFloat t_min(tmin);
+    // the rays of a packet are coherent, so the first lane's signs
+    // decide which child is nearer for all of them
+    Ray first_ray = r.getRay(0);
+    bool negative[3] = {first_ray.getDirection().x() < 0,
+                        first_ray.getDirection().y() < 0,
+                        first_ray.getDirection().z() < 0};
+
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node &node = nodes[stack[--top]];
+        RAYSTAT(bvh_nodes);
+
+        // (min - o) * inv is NaN when the ray lies in the slab plane;
+        // the candidate goes first so min/max keep the other operand then
+        SimdFloat t_near = t_min;
+        SimdFloat t_far = h.getT();
+        SimdFloat t0 = (SimdFloat(node.min.x()) - ro.x) * inv.x;
+        SimdFloat t1 = (SimdFloat(node.max.x()) - ro.x) * inv.x;
+        t_near = simdMax(simdMin(t0, t1), t_near);
+        t_far = simdMin(simdMax(t0, t1), t_far);
+        t0 = (SimdFloat(node.min.y()) - ro.y) * inv.y;
+        t1 = (SimdFloat(node.max.y()) - ro.y) * inv.y;
+        t_near = simdMax(simdMin(t0, t1), t_near);
+        t_far = simdMin(simdMax(t0, t1), t_far);
+        t0 = (SimdFloat(node.min.z()) - ro.z) * inv.z;
+        t1 = (SimdFloat(node.max.z()) - ro.z) * inv.z;
+        t_near = simdMax(simdMin(t0, t1), t_near);
+        t_far = simdMin(simdMax(t0, t1), t_far);
+        if (simdBits(t_near <= t_far) == 0) continue;
+
+        if (node.count > 0) {
+            for (int i = node.offset; i < node.offset + node.count; i++) {
+                primitives[i].object->intersectFacePacket(primitives[i].face, r, h, tmin);
+            }
+        } else {
+            int first = &node - &nodes[0] + 1;
+            int second = node.offset;
+            if (negative[node.axis]) swap(first, second);
+            assert(top + 2 <= BVH_STACK_SIZE);
+            stack[top++] = second;
+            stack[top++] = first;
+        }
+    }
+}
+
+void BVH::paint() const {
+    // the faces of a mesh are scattered over the leaves, paint the scene as given
+    root->paint();
+}
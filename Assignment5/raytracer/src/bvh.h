@@ -0,0 +1,124 @@
+#ifndef RAYTRACER_BVH_H
+#define RAYTRACER_BVH_H
+
+#include "object3d.h"
+#include "sceneCache.h"
+#include <vector>
+#include <type_traits>
+#include <unordered_map>
+
+class BVH;
+
+// ====================================================================
+// ====================================================================
+// The bottom level BVHs of the objects Transforms place in the scene,
+// owned by the top level accelerator.  An object shared by many
+// Transforms (the parser shares meshes, see SceneParser) gets a single
+// BVH, so a thousand instances of a mesh cost one mesh, one BVH and a
+// thousand Transforms.
+
+class BVHInstances {
+public:
+    BVHInstances() {}
+
+    BVHInstances(const BVHInstances &) = delete;
+
+    BVHInstances &operator=(const BVHInstances &) = delete;
+
+    // points transform at the BVH of object, built on first use; none
+    // when the object is a single primitive anyway
+    void attach(Transform *transform, Object3D *object);
+
+    // the Transforms go back to intersecting their objects directly
+    ~BVHInstances();
+
+private:
+    unordered_map<Object3D *, BVH *> bvhs;
+    vector<Transform *> transforms;
+};
+
+// ====================================================================
+// ====================================================================
+// Bounding volume hierarchy over the primitives of a scene (objects,
+// or single faces of a mesh), built with
+// the surface area heuristic.  The tree is stored flattened in depth
+// first order: the left child of an interior node is the next node in
+// the array and the node stores the index of its right child.
+// Unbounded primitives (planes) can't go into the tree and are tested
+// against every ray.
+
+class BVH : public Object3D {
+public:
+    // takes the tree from the cache when it has one for these
+    // primitives, or else builds it and hands it to the cache.  The
+    // Transforms below root get their BVHs from instances, or from a
+    // table of this BVH's own when it is the top level one
+    BVH(Object3D *_root, SceneCache *cache = nullptr, BVHInstances *_instances = nullptr);
+
+    bool intersect(const Ray &r, Hit &h, float tmin) const override;
+
+    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) const override;
+
+    // packet traversal: a node is entered when any lane's ray hits its box
+    void intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const override;
+
+    void paint() const override;
+
+    BoundingBox *getBoundingBox() override { return boundingBox; }
+
+    void insertIntoThis(Object3D *obj);
+
+    // one face of a mesh, bounded by bb
+    void insertFace(Object3D *obj, int face, BoundingBox *bb);
+
+    int getNumNodes() const { return nodes.size(); }
+
+    // whether node_bytes of raw nodes (from a cache) make a tree over
+    // num_primitives primitives that the traversal can walk safely
+    static bool checkNodes(const char *data, size_t node_bytes, int num_primitives);
+
+    int getNumPrimitives() const { return primitives.size() + unbounded.size(); }
+
+    BVHInstances *getInstances() const { return instances; }
+
+    ~BVH() override {
+        if (own_instances) delete instances;
+        delete boundingBox;
+    }
+
+private:
+    struct Node {
+        Vec3f min;
+        Vec3f max;
+        int offset;     // leaf: first primitive, interior: right child
+        int count;      // number of primitives, 0 for interior nodes
+        int axis;       // split axis of interior nodes
+    };
+
+    // the scene cache keeps the nodes as they are
+    static_assert(is_trivially_copyable<Node>::value, "BVH nodes are saved and loaded with memcpy");
+
+    // primitive bounds and centroids, only needed while building
+    struct BuildItem {
+        Primitive primitive;
+        int index;      // in the order of insertion
+        Vec3f min;
+        Vec3f max;
+        Vec3f centroid;
+    };
+
+    int build(vector<BuildItem> &items, int begin, int end, int depth);
+
+    template<bool anyHit>
+    bool traverse(const Ray &r, Hit &h, float tmin) const;
+
+    Object3D *root;
+    vector<Node> nodes;
+    vector<Primitive> primitives;
+    vector<Object3D *> unbounded;
+    vector<BuildItem> pending;
+    BVHInstances *instances;
+    bool own_instances;
+};
+
+#endif //RAYTRACER_BVH_H
@@ -2,7 +2,7 @@
 
 /* OrthographicCamera */
 
-Ray OrthographicCamera::generateRay(Vec2f point) {
+Ray OrthographicCamera::generateRay(Vec2f point) const {
     Vec3f origin = center + (point.x() - 0.5) * size * horizontal + (point.y() - 0.5) * size * screenUp;
     return Ray(origin, direction);
 }
@@ -65,13 +65,30 @@ void OrthographicCamera::rotateCamera(float rx, float ry) {
 
 /* PerspectiveCamera */
 
-Ray PerspectiveCamera::generateRay(Vec2f point) {
+Ray PerspectiveCamera::generateRay(Vec2f point) const {
     float dis = 0.5 / tan(angle / 2);
     Vec3f rayDir = dis * direction + (point.x() - 0.5) * horizontal + (point.y() - 0.5) * screenUp;
     rayDir.Normalize();
     return Ray(center, rayDir);
 }
 
+void PerspectiveCamera::generateRayPacket(const Vec2f *points, RayPacket &packet) const {
+    float px[SIMD_WIDTH], py[SIMD_WIDTH];
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        px[lane] = points[lane].x() - 0.5f;
+        py[lane] = points[lane].y() - 0.5f;
+    }
+    SimdFloat x = SimdFloat::load(px);
+    SimdFloat y = SimdFloat::load(py);
+    float dis = 0.5 / tan(angle / 2);
+    SimdVec3f rayDir(SimdFloat(dis * direction.x()) + x * SimdFloat(horizontal.x()) + y * SimdFloat(screenUp.x()),
+                     SimdFloat(dis * direction.y()) + x * SimdFloat(horizontal.y()) + y * SimdFloat(screenUp.y()),
+                     SimdFloat(dis * direction.z()) + x * SimdFloat(horizontal.z()) + y * SimdFloat(screenUp.z()));
+    rayDir = rayDir * (SimdFloat(1) / simdSqrt(rayDir.Dot3(rayDir)));
+    SimdVec3f origin(SimdFloat(center.x()), SimdFloat(center.y()), SimdFloat(center.z()));
+    packet = RayPacket(origin, rayDir);
+}
+
 float PerspectiveCamera::getTMin() const {
     return 0;
 }
@@ -5,6 +5,7 @@
 //#include <GL/glu.h>
 #include <GL/freeglut.h>
 #include "ray.h"
+#include "rayPacket.h"
 #include "LAlib/vectors.h"
 #include "LAlib/matrix.h"
 
@@ -12,7 +13,16 @@ class Camera {
 public:
     Camera() {}
 
-    virtual Ray generateRay(Vec2f point) = 0;
+    virtual Ray generateRay(Vec2f point) const = 0;
+
+    // one ray per lane, points[lane] in the same [0,1] screen coordinates
+    virtual void generateRayPacket(const Vec2f *points, RayPacket &packet) const {
+        Ray rays[SIMD_WIDTH];
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            rays[lane] = generateRay(points[lane]);
+        }
+        packet = RayPacket(rays);
+    }
 
     virtual float getTMin() const = 0;
 
@@ -41,7 +51,7 @@ public:
         screenUp.Normalize();
     }
 
-    Ray generateRay(Vec2f point) override;
+    Ray generateRay(Vec2f point) const override;
 
     float getTMin() const override;
 
@@ -79,7 +89,9 @@ public:
         screenUp.Normalize();
     }
 
-    Ray generateRay(Vec2f point) override;
+    Ray generateRay(Vec2f point) const override;
+
+    void generateRayPacket(const Vec2f *points, RayPacket &packet) const override;
 
     float getTMin() const override;
 
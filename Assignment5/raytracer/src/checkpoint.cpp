@@ -0,0 +1,161 @@
+#include "checkpoint.h"
+#include <errno.h>
+#include <string.h>
+#include <filesystem>
+#include <type_traits>
+#include "mappedFile.h"
+
+static_assert(sizeof(Vec3f) == 3 * sizeof(float), "Vec3f arrays are written as they are");
+static_assert(sizeof(FilmSum) == 4 * sizeof(float), "FilmSum arrays are written as they are");
+static_assert(is_trivially_copyable<Vec3f>::value, "Vec3f arrays are loaded with memcpy");
+static_assert(is_trivially_copyable<FilmSum>::value, "FilmSum arrays are loaded with memcpy");
+
+#define CHECKPOINT_MAGIC "RTCKPT\r\n"
+#define CHECKPOINT_VERSION 2
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t num_slots;
+    uint64_t settings;
+    int32_t pass;
+    uint32_t num_tiles;
+    uint64_t num_costs;
+    // byte offsets of the arrays, from the start of the file
+    uint64_t counts;
+    uint64_t first;
+    uint64_t sums;
+    uint64_t done;
+    uint64_t depth;
+    uint64_t normals;
+    uint64_t cost;
+    uint64_t size;
+};
+
+uint64_t Checkpoint::hash(const char *text) {
+    return hash(text, strlen(text));
+}
+
+uint64_t Checkpoint::hash(const char *data, size_t size, uint64_t h) {
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// ====================================================================
+// ====================================================================
+
+bool Checkpoint::save(const RenderState &state) const {
+    const Film &film = *state.film;
+    uint64_t pixels = uint64_t(film.getWidth()) * film.getHeight();
+    uint64_t sums = film.isFiltered() ? pixels * film.getNumSlots() : 0;
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, 8);
+    header.version = CHECKPOINT_VERSION;
+    header.width = film.getWidth();
+    header.height = film.getHeight();
+    header.num_slots = film.getNumSlots();
+    header.settings = settings;
+    header.pass = state.pass;
+    header.num_tiles = state.done->size();
+    header.num_costs = state.cost->size();
+    header.counts = mappedAlign(sizeof(header));
+    header.first = mappedAlign(header.counts + pixels * sizeof(int));
+    header.sums = mappedAlign(header.first + pixels * sizeof(Vec3f));
+    header.done = mappedAlign(header.sums + sums * sizeof(FilmSum));
+    header.depth = mappedAlign(header.done + header.num_tiles);
+    header.normals = mappedAlign(header.depth + pixels * sizeof(Vec3f));
+    header.cost = mappedAlign(header.normals + pixels * sizeof(Vec3f));
+    header.size = header.cost + header.num_costs * sizeof(double);
+
+    filesystem::path part(filename);
+    part += ".part";
+    FILE *file = fopen(part.string().c_str(), "wb");
+    if (file == NULL) {
+        printf("whoops can't write checkpoint '%s': %s\n", part.string().c_str(), strerror(errno));
+        return false;
+    }
+    // an Image keeps its pixels in one row major array
+    bool written = writeAt(file, 0, &header, sizeof(header)) &&
+                   writeAt(file, header.counts, film.getCountData(), pixels * sizeof(int)) &&
+                   writeAt(file, header.first, film.getFirstData(), pixels * sizeof(Vec3f)) &&
+                   writeAt(file, header.sums, film.getSumData(), sums * sizeof(FilmSum)) &&
+                   writeAt(file, header.done, state.done->data(), header.num_tiles) &&
+                   writeAt(file, header.depth, &state.depth->GetPixel(0, 0), pixels * sizeof(Vec3f)) &&
+                   writeAt(file, header.normals, &state.normals->GetPixel(0, 0), pixels * sizeof(Vec3f)) &&
+                   writeAt(file, header.cost, state.cost->data(), header.num_costs * sizeof(double));
+    written = fclose(file) == 0 && written;
+    // a short file would replace the last good checkpoint with one that
+    // can't be resumed
+    error_code error;
+    if (written) filesystem::rename(part, filename, error);
+    if (!written || error) {
+        printf("whoops can't write checkpoint '%s', keeping the last one\n", filename);
+        filesystem::remove(part, error);
+        return false;
+    }
+    return true;
+}
+
+// ====================================================================
+// ====================================================================
+
+bool Checkpoint::load(RenderState &state) const {
+    MappedFile mapped(filename);
+    const char *data = mapped.getData();
+    size_t size = mapped.getSize();
+    if (data == nullptr) return false;
+
+    Film &film = *state.film;
+    uint64_t pixels = uint64_t(film.getWidth()) * film.getHeight();
+    uint64_t sums = film.isFiltered() ? pixels * film.getNumSlots() : 0;
+    // a checkpoint that doesn't fit is reported and left alone, the
+    // render then starts over
+    CheckpointHeader header;
+    if (size < sizeof(header) || memcmp(data, CHECKPOINT_MAGIC, 8) != 0) {
+        printf("whoops '%s' is not a checkpoint\n", filename);
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.version != CHECKPOINT_VERSION || header.size != size) {
+        printf("whoops checkpoint '%s' is from another version or cut short\n", filename);
+        return false;
+    }
+    if (header.settings != settings || header.width != uint32_t(film.getWidth()) ||
+        header.height != uint32_t(film.getHeight()) || header.num_slots != uint32_t(film.getNumSlots()) ||
+        header.num_tiles != state.done->size() || header.num_costs != state.cost->size()) {
+        printf("whoops checkpoint '%s' was made with another scene or other options\n", filename);
+        return false;
+    }
+    auto fits = [&](uint64_t offset, uint64_t bytes) { return offset <= size && bytes <= size - offset; };
+    if (header.pass < 0 || !fits(header.counts, pixels * sizeof(int)) ||
+        !fits(header.first, pixels * sizeof(Vec3f)) || !fits(header.sums, sums * sizeof(FilmSum)) ||
+        !fits(header.done, header.num_tiles) || !fits(header.depth, pixels * sizeof(Vec3f)) ||
+        !fits(header.normals, pixels * sizeof(Vec3f)) || !fits(header.cost, header.num_costs * sizeof(double))) {
+        printf("whoops checkpoint '%s' is damaged\n", filename);
+        return false;
+    }
+
+    memcpy(film.getCountData(), data + header.counts, pixels * sizeof(int));
+    memcpy(film.getFirstData(), data + header.first, pixels * sizeof(Vec3f));
+    if (sums > 0) memcpy(film.getSumData(), data + header.sums, sums * sizeof(FilmSum));
+    memcpy(state.done->data(), data + header.done, header.num_tiles);
+    const float *depth = (const float *) (data + header.depth);
+    const float *normals = (const float *) (data + header.normals);
+    for (int j = 0; j < film.getHeight(); j++) {
+        for (int i = 0; i < film.getWidth(); i++) {
+            size_t p = 3 * (size_t(j) * film.getWidth() + i);
+            state.depth->SetPixel(i, j, Vec3f(depth[p], depth[p + 1], depth[p + 2]));
+            state.normals->SetPixel(i, j, Vec3f(normals[p], normals[p + 1], normals[p + 2]));
+        }
+    }
+    memcpy(state.cost->data(), data + header.cost, header.num_costs * sizeof(double));
+    state.pass = header.pass;
+    return true;
+}
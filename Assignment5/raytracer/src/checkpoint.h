@@ -0,0 +1,51 @@
+#ifndef RAYTRACER_CHECKPOINT_H
+#define RAYTRACER_CHECKPOINT_H
+
+#include <stdint.h>
+#include <vector>
+#include "film.h"
+#include "Imglib/image.h"
+
+using namespace std;
+
+// ====================================================================
+// ====================================================================
+// The state of an unfinished progressive render: the film, the depth
+// and normals images, the per-pixel costs, the pass it was in and
+// which tiles of that pass are done.  The file is a fixed header
+// followed by the raw arrays at 64 byte aligned offsets, so resuming
+// maps it and copies the arrays instead of parsing anything.  The
+// settings hash guards against resuming with a different scene or
+// different render options.
+
+struct RenderState {
+    Film *film;
+    Image *depth;
+    Image *normals;
+    vector<double> *cost;
+    int pass;
+    vector<char> *done;
+};
+
+class Checkpoint {
+public:
+    Checkpoint(const char *_filename, uint64_t _settings) : filename(_filename), settings(_settings) {}
+
+    // FNV-1a, for the settings string and the files of the scene
+    static uint64_t hash(const char *text);
+
+    static uint64_t hash(const char *data, size_t size, uint64_t h = 14695981039346656037ull);
+
+    // written next to the file and renamed, like the images; false (and
+    // the last checkpoint left alone) if it couldn't be written
+    bool save(const RenderState &state) const;
+
+    // false if there is no checkpoint yet, or none made with these settings
+    bool load(RenderState &state) const;
+
+private:
+    const char *filename;
+    uint64_t settings;
+};
+
+#endif //RAYTRACER_CHECKPOINT_H
@@ -0,0 +1,24 @@
+#include "film.h"
+#include "filter.h"
+
+Film::Film(int _width, int _height, const Filter *_filter) :
+        width(_width), height(_height), filter(_filter), radius(_filter ? _filter->getSupportRadius() : 0),
+        counts(size_t(_width) * _height, 0), first(size_t(_width) * _height),
+        sums(_filter ? size_t(_width) * _height * getNumSlots() : 0, FilmSum{Vec3f(0, 0, 0), 0}) {}
+
+void Film::addSample(int i, int j, const Vec2f &offset, const Vec3f &color) {
+    int &count = counts[j * width + i];
+    if (count == 0) first[j * width + i] = color;
+    count++;
+    if (filter == nullptr) return;
+    // the sample as seen from the center of every pixel around it
+    FilmSum *slot = &sums[(size_t(j) * width + i) * getNumSlots()];
+    for (int dy = -radius; dy <= radius; dy++) {
+        for (int dx = -radius; dx <= radius; dx++, slot++) {
+            float weight = filter->getWeight(offset.x() - 0.5f - dx, offset.y() - 0.5f - dy);
+            if (weight <= 0) continue;
+            slot->color += weight * color;
+            slot->weight += weight;
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef RAYTRACER_FILM_H
+#define RAYTRACER_FILM_H
+
+#include <assert.h>
+#include <vector>
+#include "LAlib/vectors.h"
+
+using namespace std;
+
+class Filter;
+
+// ====================================================================
+// ====================================================================
+// What the reconstruction filter needs of the samples of every pixel,
+// without keeping the samples.  A sample is weighted once for every
+// pixel within the filter's support, and the pixel it belongs to keeps
+// one running sum per such neighbour (its slots), so the memory does
+// not grow with the number of samples.  A pixel only ever writes its
+// own slots, so tiles can still be traced in any order and on any
+// thread and add up to the same image.  The offset of a sample is its
+// position inside the pixel, in [0, 1) x [0, 1).
+
+struct FilmSum {
+    Vec3f color;
+    float weight;
+};
+
+class Film {
+public:
+    // without a filter only the first sample of every pixel is kept
+    Film(int _width, int _height, const Filter *_filter);
+
+    int getWidth() const { return width; }
+
+    int getHeight() const { return height; }
+
+    int getNumSamples(int i, int j) const { return counts[j * width + i]; }
+
+    // the color of sample 0, what a pixel shows before it is filtered
+    const Vec3f &getFirstColor(int i, int j) const {
+        assert(counts[j * width + i] > 0);
+        return first[j * width + i];
+    }
+
+    // whether there are sums at all
+    bool isFiltered() const { return filter != nullptr; }
+
+    // how many pixels around a pixel its samples are weighted for
+    int getSupportRadius() const { return radius; }
+
+    int getNumSlots() const { return (2 * radius + 1) * (2 * radius + 1); }
+
+    // the weighted samples of pixel (x, y) for the pixel dx, dy from it
+    const FilmSum &getSum(int x, int y, int dx, int dy) const {
+        return sums[(size_t(y) * width + x) * getNumSlots() + (dy + radius) * (2 * radius + 1) + dx + radius];
+    }
+
+    // only one thread may add to a pixel at a time
+    void addSample(int i, int j, const Vec2f &offset, const Vec3f &color);
+
+    // the raw storage, width * height counts and first colors and, if
+    // filtered, getNumSlots() sums per pixel, for checkpoints
+    int *getCountData() { return counts.data(); }
+
+    const int *getCountData() const { return counts.data(); }
+
+    Vec3f *getFirstData() { return first.data(); }
+
+    const Vec3f *getFirstData() const { return first.data(); }
+
+    FilmSum *getSumData() { return sums.data(); }
+
+    const FilmSum *getSumData() const { return sums.data(); }
+
+private:
+    int width;
+    int height;
+    const Filter *filter;
+    int radius;
+    vector<int> counts;
+    vector<Vec3f> first;
+    vector<FilmSum> sums;
+};
+
+#endif //RAYTRACER_FILM_H
@@ -0,0 +1,35 @@
+#include "filter.h"
+#include <algorithm>
+
+Vec3f Filter::getColor(int i, int j, const Film &film) const {
+    // the film has weighted every sample for this filter already
+    int r = film.getSupportRadius();
+    assert(r == getSupportRadius());
+    Vec3f color(0, 0, 0);
+    float total = 0;
+    for (int y = max(j - r, 0); y <= min(j + r, film.getHeight() - 1); y++) {
+        for (int x = max(i - r, 0); x <= min(i + r, film.getWidth() - 1); x++) {
+            const FilmSum &sum = film.getSum(x, y, i - x, j - y);
+            color += sum.color;
+            total += sum.weight;
+        }
+    }
+    // a filter narrower than the sample spacing may catch nothing
+    if (total <= 0) return film.getFirstColor(i, j);
+    return (1.0f / total) * color;
+}
+
+float BoxFilter::getWeight(float x, float y) const {
+    return fabs(x) < radius && fabs(y) < radius ? 1.0f : 0.0f;
+}
+
+float TentFilter::getWeight(float x, float y) const {
+    float d = sqrt(x * x + y * y);
+    return d < radius ? 1.0f - d / radius : 0.0f;
+}
+
+float GaussianFilter::getWeight(float x, float y) const {
+    float d2 = x * x + y * y;
+    if (d2 > 4 * sigma * sigma) return 0.0f;
+    return exp(-d2 / (2 * sigma * sigma));
+}
@@ -0,0 +1,71 @@
+#ifndef RAYTRACER_FILTER_H
+#define RAYTRACER_FILTER_H
+
+#include <math.h>
+#include "film.h"
+
+// ====================================================================
+// ====================================================================
+// Reconstruction filters.  The color of a pixel is the weighted
+// average of the samples of every pixel within the support radius,
+// weighted by their distance (in pixels) to the center of the pixel.
+// The Film adds up the weights as the samples come in, it has to be
+// made with the filter that develops it.
+
+class Filter {
+public:
+    virtual ~Filter() = default;
+
+    Vec3f getColor(int i, int j, const Film &film) const;
+
+    // x, y: offset of the sample from the pixel center
+    virtual float getWeight(float x, float y) const = 0;
+
+    // how many pixels around a pixel its samples can come from
+    virtual int getSupportRadius() const = 0;
+};
+
+// ====================================================================
+
+class BoxFilter : public Filter {
+public:
+    explicit BoxFilter(float _radius) : radius(_radius) {}
+
+    float getWeight(float x, float y) const override;
+
+    int getSupportRadius() const override { return int(ceil(radius - 0.5f)); }
+
+private:
+    float radius;
+};
+
+// ====================================================================
+
+class TentFilter : public Filter {
+public:
+    explicit TentFilter(float _radius) : radius(_radius) {}
+
+    float getWeight(float x, float y) const override;
+
+    int getSupportRadius() const override { return int(ceil(radius - 0.5f)); }
+
+private:
+    float radius;
+};
+
+// ====================================================================
+// cut off at 2 sigma, where the weight is down to 13%
+
+class GaussianFilter : public Filter {
+public:
+    explicit GaussianFilter(float _sigma) : sigma(_sigma) {}
+
+    float getWeight(float x, float y) const override;
+
+    int getSupportRadius() const override { return int(ceil(2 * sigma - 0.5f)); }
+
+private:
+    float sigma;
+};
+
+#endif //RAYTRACER_FILTER_H
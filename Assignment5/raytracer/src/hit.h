@@ -6,6 +6,8 @@
 
 class Material;
 
+class Object3D;
+
 // ====================================================================
 // ====================================================================
 
@@ -13,12 +15,16 @@ class Hit {
 
 public:
     // CONSTRUCTOR & DESTRUCTOR
-    Hit() { material = NULL; }
+    Hit() {
+        material = NULL;
+        object = NULL;
+    }
 
     Hit(float _t, Material *m, Vec3f n) {
         t = _t;
         material = m;
         normal = n;
+        object = NULL;
     }
 
     Hit(const Hit &h) {
@@ -26,6 +32,7 @@ public:
         material = h.material;
         normal = h.normal;
         intersectionPoint = h.intersectionPoint;
+        object = h.object;
     }
 
     ~Hit() {}
@@ -39,16 +46,20 @@ public:
 
     Vec3f getIntersectionPoint() const { return intersectionPoint; }
 
+    // the object hit: a whole mesh, or the outermost Transform of an instance
+    const Object3D *getObject() const { return object; }
+
     void negateNormal() {
         normal.Negate();
     }
 
     // MODIFIER
-    void set(float _t, Material *m, Vec3f n, const Ray &ray) {
+    void set(float _t, Material *m, Vec3f n, const Ray &ray, const Object3D *o = NULL) {
         t = _t;
         material = m;
         normal = n;
         intersectionPoint = ray.pointAtParameter(t);
+        object = o;
     }
 
 private:
@@ -57,6 +68,7 @@ private:
     Material *material;
     Vec3f normal;
     Vec3f intersectionPoint;
+    const Object3D *object;
 };
 
 inline ostream &operator<<(ostream &os, const Hit &h) {
@@ -2,6 +2,13 @@
 #include <iostream>
 #include <cstring>
 #include <assert.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <typeinfo>
+#include <vector>
 #include "scene_parser.h"
 #include "Imglib/image.h"
 #include "LAlib/vectors.h"
@@ -10,6 +17,14 @@
 #include "object3d.h"
 #include "glCanvas.h"
 #include "rayTracer.h"
+#include "tileScheduler.h"
+#include "rayStats.h"
+#include "sampler.h"
+#include "filter.h"
+#include "checkpoint.h"
+#include "tileCoordinator.h"
+#include "sceneCache.h"
+#include "mappedFile.h"
 
 typedef bool b;
 using namespace std;
@@ -28,6 +43,9 @@ char *input_file = NULL;
 char *output_file = NULL;
 char *depth_file = NULL;
 char *normals_file = NULL;
+char *cost_file = NULL;
+char *cache_file = NULL;
+bool cost_time = false;
 
 bool shade_back = false;
 bool gouraud = false;
@@ -43,6 +61,33 @@ int nz = 0;
 
 bool gridOrNot = false;
 bool visualize_grid = false;
+bool bvhOrNot = false;
+
+int num_threads = 1;
+bool packets = false;
+bool stats = false;
+
+/* Antialiasing, NULL sampler: one ray through the corner of every pixel */
+Sampler *sampler = NULL;
+Filter *filter = NULL;
+bool adaptive = false;
+float adaptive_threshold = 0;
+
+/* Progressive rendering, a time_limit of 0 runs until the image is done */
+bool progressive = false;
+double time_limit = 0;
+double flush_interval = 10;
+char *checkpoint_file = NULL;
+bool resume = false;
+
+/* Distributed rendering: a coordinator with local and/or remote workers */
+int num_workers = 0;
+char *listen_address = NULL;
+char *connect_address = NULL;
+
+/* Built once in main() and shared by every render and GUI ray query */
+SceneParser *scene = NULL;
+RayTracer *rayTracer = NULL;
 
 void argParser(int argc, char **argv);
 
@@ -50,20 +95,59 @@ void render();
 
 void glRayTracer(float x, float y);
 
+static int floatsPerPixel();
+
+static void traceTile(const TileScheduler::Tile &tile, float *data);
+
+static uint64_t renderSettings();
+
+static uint64_t filterSettings();
+
+static void logGridResolution(FILE *out);
+
 int main(int argc, char **argv) {
     argParser(argc, argv);
-    SceneParser *scene = new SceneParser(input_file);
+    scene = new SceneParser(input_file, cache_file);
+    rayTracer = new RayTracer(scene, max_bounces, cutoff_weight, shadows, shade_back,
+                              gridOrNot, nx, ny, nz, visualize_grid, bvhOrNot);
+    if (scene->getCache() != NULL) scene->getCache()->save();
+    if (gridOrNot && nx == 0) logGridResolution(stdout);
 
-    Grid *grid = nullptr;
-    if (nx != 0 && ny != 0 && nz != 0) {
-        grid = new Grid(scene->getGroup()->getBoundingBox(), nx, ny, nz);
-        scene->getGroup()->insertIntoGrid(grid, nullptr);
-    }
-    if (gui) {
+    if (connect_address != NULL) {
+        TileCoordinator::work(connect_address, floatsPerPixel(), renderSettings(), traceTile);
+    } else if (gui) {
         GLCanvas canvas;
         glutInit(&argc, argv);
-        canvas.initialize(scene, render, glRayTracer, grid, visualize_grid);
+        canvas.initialize(scene, render, glRayTracer, rayTracer->getGrid(), visualize_grid);
     } else render();
+
+    delete rayTracer;
+    delete scene;
+    delete sampler;
+    delete filter;
+}
+
+// what -grid auto picked
+static void logGridResolution(FILE *out) {
+    Grid *grid = rayTracer->getGrid();
+    Vec3f n = grid->getGrid();
+    long long occupied = grid->getNumOccupiedCells();
+    fprintf(out, "grid auto: %dx%dx%d for %d primitives, %.2f entries per occupied cell\n",
+            int(n.x()), int(n.y()), int(n.z()), scene->getGroup()->getNumPrimitives(),
+            occupied > 0 ? double(grid->getNumEntries()) / occupied : 0.0);
+}
+
+// "90", "90s", "1.5m" or "2h"
+static double parseSeconds(const char *text) {
+    char *unit;
+    double seconds = strtod(text, &unit);
+    if (!strcmp(unit, "m")) seconds *= 60;
+    else if (!strcmp(unit, "h")) seconds *= 3600;
+    else if (strcmp(unit, "") != 0 && strcmp(unit, "s") != 0) {
+        printf("whoops unknown time unit in '%s'\n", text);
+        assert(0);
+    }
+    return seconds;
 }
 
 void argParser(int argc, char **argv) {
@@ -97,6 +181,16 @@ void argParser(int argc, char **argv) {
             i++;
             assert(i < argc);
             normals_file = argv[i];
+        } else if (!strcmp(argv[i], "-cost")) {
+            i++;
+            assert(i < argc);
+            cost_file = argv[i];
+        } else if (!strcmp(argv[i], "-cost_time")) {
+            cost_time = true;
+        } else if (!strcmp(argv[i], "-cache")) {
+            i++;
+            assert(i < argc);
+            cache_file = argv[i];
         } else if (!strcmp(argv[i], "-shade_back")) {
             shade_back = true;
         } else if (!strcmp(argv[i], "-gui")) {
@@ -124,6 +218,8 @@ void argParser(int argc, char **argv) {
             gridOrNot = true;
             i++;
             assert(i < argc);
+            // -grid auto leaves nx, ny and nz at 0 for the RayTracer to pick
+            if (!strcmp(argv[i], "auto")) continue;
             nx = atoi(argv[i]);
             i++;
             assert(i < argc);
@@ -133,67 +229,560 @@ void argParser(int argc, char **argv) {
             nz = atoi(argv[i]);
         } else if (!strcmp(argv[i], "-visualize_grid")) {
             visualize_grid = true;
+        } else if (!strcmp(argv[i], "-accel")) {
+            i++;
+            assert(i < argc);
+            if (!strcmp(argv[i], "bvh")) bvhOrNot = true;
+            else if (!strcmp(argv[i], "none")) bvhOrNot = false;
+            else {
+                printf("whoops unknown acceleration structure '%s'\n", argv[i]);
+                assert(0);
+            }
+        } else if (!strcmp(argv[i], "-stats")) {
+            stats = true;
+        } else if (!strcmp(argv[i], "-packets")) {
+            packets = true;
+        } else if (!strcmp(argv[i], "-threads")) {
+            i++;
+            assert(i < argc);
+            num_threads = atoi(argv[i]);
+            if (num_threads <= 0) num_threads = thread::hardware_concurrency();
+        } else if (!strcmp(argv[i], "-samples") || !strcmp(argv[i], "-jittered_samples")) {
+            i++;
+            assert(i < argc);
+            delete sampler;
+            sampler = new JitteredSampler(atoi(argv[i]));
+        } else if (!strcmp(argv[i], "-uniform_samples")) {
+            i++;
+            assert(i < argc);
+            delete sampler;
+            sampler = new UniformSampler(atoi(argv[i]));
+        } else if (!strcmp(argv[i], "-random_samples")) {
+            i++;
+            assert(i < argc);
+            delete sampler;
+            sampler = new RandomSampler(atoi(argv[i]));
+        } else if (!strcmp(argv[i], "-adaptive")) {
+            adaptive = true;
+            i++;
+            assert(i < argc);
+            adaptive_threshold = atof(argv[i]);
+        } else if (!strcmp(argv[i], "-progressive")) {
+            progressive = true;
+        } else if (!strcmp(argv[i], "-time_limit")) {
+            progressive = true;
+            i++;
+            assert(i < argc);
+            time_limit = parseSeconds(argv[i]);
+        } else if (!strcmp(argv[i], "-flush_interval")) {
+            i++;
+            assert(i < argc);
+            flush_interval = parseSeconds(argv[i]);
+            assert(flush_interval > 0);
+        } else if (!strcmp(argv[i], "-checkpoint")) {
+            progressive = true;
+            i++;
+            assert(i < argc);
+            checkpoint_file = argv[i];
+        } else if (!strcmp(argv[i], "-resume")) {
+            resume = true;
+        } else if (!strcmp(argv[i], "-workers")) {
+            i++;
+            assert(i < argc);
+            num_workers = atoi(argv[i]);
+            if (num_workers < 0) num_workers = thread::hardware_concurrency();
+        } else if (!strcmp(argv[i], "-listen")) {
+            i++;
+            assert(i < argc);
+            listen_address = argv[i];
+        } else if (!strcmp(argv[i], "-connect")) {
+            i++;
+            assert(i < argc);
+            connect_address = argv[i];
+        } else if (!strcmp(argv[i], "-box_filter")) {
+            i++;
+            assert(i < argc);
+            delete filter;
+            filter = new BoxFilter(atof(argv[i]));
+        } else if (!strcmp(argv[i], "-tent_filter")) {
+            i++;
+            assert(i < argc);
+            delete filter;
+            filter = new TentFilter(atof(argv[i]));
+        } else if (!strcmp(argv[i], "-gaussian_filter")) {
+            i++;
+            assert(i < argc);
+            delete filter;
+            filter = new GaussianFilter(atof(argv[i]));
         } else {
             printf("whoops error with command line argument %d: '%s'\n", i, argv[i]);
             assert(0);
         }
     }
+    if (sampler != NULL) {
+        assert(sampler->getNumSamples() > 0);
+        if (filter == NULL) filter = new BoxFilter(0.5);
+    }
+    if ((adaptive || filter != NULL) && sampler == NULL) {
+        printf("whoops -adaptive and the filters need -samples\n");
+        assert(0);
+    }
+    // the intersection tests are only counted in a stats build
+    if (!RAYTRACER_STATS && !cost_time) {
+        if (cost_file != NULL) printf("cost: intersection tests aren't counted in this build, timing the pixels\n");
+        cost_time = true;
+    }
+    if (resume && checkpoint_file == NULL) {
+        printf("whoops -resume needs -checkpoint\n");
+        assert(0);
+    }
+    if ((num_workers > 0 || listen_address != NULL) && (adaptive || progressive)) {
+        printf("whoops -adaptive and -progressive can't be rendered by workers\n");
+        assert(0);
+    }
+    if (adaptive && progressive) {
+        printf("whoops -adaptive can't be rendered progressively\n");
+        assert(0);
+    }
+}
+
+// false color for v in [0, 1]: black, blue, cyan, green, yellow, red
+static Vec3f heatColor(float v) {
+    static const Vec3f ramp[6] = {Vec3f(0, 0, 0), Vec3f(0, 0, 1), Vec3f(0, 1, 1),
+                                  Vec3f(0, 1, 0), Vec3f(1, 1, 0), Vec3f(1, 0, 0)};
+    v = max(0.0f, min(v, 1.0f)) * 5;
+    int k = min(int(v), 4);
+    float f = v - k;
+    return ramp[k] * (1 - f) + ramp[k + 1] * f;
+}
+
+// writes next to the file and renames, so a job killed while saving
+// still leaves the previous image behind
+static void saveTGA(const Image &image, const char *filename) {
+    filesystem::path part(filename);
+    part.replace_extension(".part" + part.extension().string());
+    image.SaveTGA(part.string().c_str());
+    filesystem::rename(part, filename);
+}
+
+// set by SIGINT and SIGTERM, a progressive render then stops at the next tile
+static atomic<bool> interrupted(false);
+
+static void onInterrupt(int) {
+    interrupted = true;
+}
+
+// everything that changes the samples, which has to match to resume a
+// checkpoint or to work for a coordinator: the options and the contents
+// of the scene file and of every OBJ file it reads (not their names, a
+// worker may keep them elsewhere).  The filter and the time limits may differ
+// for a coordinator, a checkpoint also needs the same filter
+static uint64_t renderSettings() {
+    char settings[1024];
+    snprintf(settings, sizeof(settings), "%d %d %s %d %d %g %d %d %g %g", width, height,
+             sampler != NULL ? typeid(*sampler).name() : "corner", sampler != NULL ? sampler->getNumSamples() : 1,
+             max_bounces, cutoff_weight, shadows, shade_back, depth_min, depth_max);
+    uint64_t h = Checkpoint::hash(settings);
+    for (const string &name: scene->getFiles()) {
+        // NULL for an empty file
+        MappedFile file(name.c_str());
+        if (file.getData() != nullptr) h = Checkpoint::hash(file.getData(), file.getSize(), h);
+    }
+    return h;
+}
+
+// the film of a checkpoint keeps the samples weighted by the filter: its
+// radius and its weights on a grid inside that radius
+static uint64_t filterSettings() {
+    if (filter == NULL) return Checkpoint::hash("none");
+    int r = filter->getSupportRadius();
+    uint64_t h = Checkpoint::hash(typeid(*filter).name());
+    h = Checkpoint::hash((const char *) &r, sizeof(r), h);
+    for (float y = -r - 0.5f; y <= r + 0.5f; y += 0.125f) {
+        for (float x = -r - 0.5f; x <= r + 0.5f; x += 0.125f) {
+            float weight = filter->getWeight(x, y);
+            h = Checkpoint::hash((const char *) &weight, sizeof(weight), h);
+        }
+    }
+    return h;
+}
+
+// a pixel from a worker: its cost, the t and normal of sample 0 and
+// then the offset and color of every sample
+static int floatsPerPixel() {
+    return 5 + 5 * (sampler != NULL ? sampler->getNumSamples() : 1);
+}
+
+static void traceTile(const TileScheduler::Tile &tile, float *data) {
+    Camera *camera = scene->getCamera();
+    int num_samples = sampler != NULL ? sampler->getNumSamples() : 1;
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            float *pixel = data;
+            data += floatsPerPixel();
+            auto start = chrono::steady_clock::now();
+            long long tests = RayStats::local().getIntersectionTests();
+            for (int n = 0; n < num_samples; n++) {
+                Vec2f offset = sampler != NULL ? sampler->getSamplePosition(i, j, n) : Vec2f(0, 0);
+                Ray ray = camera->generateRay(Vec2f((i + offset.x()) / float(width), (j + offset.y()) / float(height)));
+                Hit hit(INFINITY, nullptr, Vec3f(0.0, 0.0, 0.0));
+                Vec3f color = rayTracer->traceRay(ray, camera->getTMin(), 0, 1.0, 1.0, hit);
+                if (n == 0) {
+                    pixel[1] = hit.getT();
+                    pixel[2] = hit.getNormal().x();
+                    pixel[3] = hit.getNormal().y();
+                    pixel[4] = hit.getNormal().z();
+                }
+                float *sample = pixel + 5 + 5 * n;
+                sample[0] = offset.x();
+                sample[1] = offset.y();
+                sample[2] = color.x();
+                sample[3] = color.y();
+                sample[4] = color.z();
+            }
+            pixel[0] = cost_time ? chrono::duration<float, nano>(chrono::steady_clock::now() - start).count()
+                                 : float(RayStats::local().getIntersectionTests() - tests);
+        }
+    }
+    RayStats::flush();
 }
 
 void render() {
-    SceneParser scene(input_file);
-    Camera *camera = scene.getCamera();
-    Object3D *group = scene.getGroup();
-    Vec3f ambientLight = scene.getAmbientLight();
+    // the camera may have been moved in the GUI since the last render
+    Camera *camera = scene->getCamera();
 
     Image outputImage(width, height);
-    outputImage.SetAllPixels(scene.getBackgroundColor());
+    outputImage.SetAllPixels(scene->getBackgroundColor());
     Image depthImage(width, height);
     depthImage.SetAllPixels(Vec3f(0.0, 0.0, 0.0));
     Image normalsImage(width, height);
     normalsImage.SetAllPixels(Vec3f(0.0, 0.0, 0.0));
 
-    RayTracer rayTracer(&scene, max_bounces, cutoff_weight, shadows, shade_back,
-                        gridOrNot, nx, ny, nz, visualize_grid);
+    auto writePixel = [&](int i, int j, const Vec3f &pixel_color, const Hit &hit) {
+        outputImage.SetPixel(i, j, pixel_color);
+
+        Vec3f normal = hit.getNormal();
+        normalsImage.SetPixel(i, j, Vec3f(fabs(normal.x()), fabs(normal.y()), fabs(normal.z())));
+        float t = hit.getT();
+        if (t > depth_max)
+            t = depth_max;
+        if (t < depth_min)
+            t = depth_min;
+        t = (depth_max - t) / (depth_max - depth_min);
+        depthImage.SetPixel(i, j, Vec3f(t, t, t));
+    };
+
+    // the cost of a pixel is the intersection tests (or, with -cost_time,
+    // the nanoseconds) spent on it and on all of its secondary rays
+    vector<double> cost(cost_file != NULL ? width * height : 0, 0.0);
+    auto costNow = [&]() -> double {
+        if (cost_time) {
+            return chrono::duration<double, nano>(chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        return RayStats::local().getIntersectionTests();
+    };
+
+    RayStats::reset();
+
+    TileScheduler scheduler(width, height);
+    bool complete = true;
+    if (num_workers > 0 || listen_address != NULL) {
+        // the workers send back the samples of every pixel, the filter
+        // runs here once they all are in.  Every worker traces one ray
+        // at a time on one thread, start one per core
+        int num_samples = sampler != NULL ? sampler->getNumSamples() : 1;
+        Film film(width, height, filter);
+        TileCoordinator coordinator(width, height, floatsPerPixel(), renderSettings());
+        coordinator.run(listen_address, num_workers, num_threads, traceTile, [&](const TileScheduler::Tile &tile, const float *data) {
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    const float *pixel = data;
+                    data += floatsPerPixel();
+                    if (cost_file != NULL) cost[j * width + i] = pixel[0];
+                    for (int n = 0; n < num_samples; n++) {
+                        const float *sample = pixel + 5 + 5 * n;
+                        film.addSample(i, j, Vec2f(sample[0], sample[1]), Vec3f(sample[2], sample[3], sample[4]));
+                    }
+                    Hit hit(pixel[1], nullptr, Vec3f(pixel[2], pixel[3], pixel[4]));
+                    writePixel(i, j, film.getFirstColor(i, j), hit);
+                }
+            }
+        });
+        if (sampler != NULL) {
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    outputImage.SetPixel(i, j, filter->getColor(i, j, film));
+                }
+            }
+        }
+    } else if (progressive) {
+        // sample 0 of every 8th pixel first, then of every 4th, 2nd and of
+        // the rest, then one more sample of every pixel per pass.  Once the
+        // next flush is due the tiles left in a pass wait until the image (and
+        // the checkpoint) have been saved; once the time limit is up (or on SIGTERM) they are
+        // dropped and the image stays as far as it got.  Run to the end, it
+        // is the same image as without -progressive
+        int num_samples = sampler != NULL ? sampler->getNumSamples() : 1;
+        int num_passes = 4 + num_samples - 1;
+        Film film(width, height, filter);
+
+        auto now = chrono::steady_clock::now;
+        auto deadline = time_limit > 0 ? now() + chrono::duration_cast<chrono::steady_clock::duration>(
+                chrono::duration<double>(time_limit)) : chrono::steady_clock::time_point::max();
+        auto interval = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(flush_interval));
+        auto next_flush = now() + interval;
+        auto stopped = [&]() { return interrupted || now() >= deadline; };
+        interrupted = false;
+        signal(SIGINT, onInterrupt);
+        signal(SIGTERM, onInterrupt);
+
+        auto develop = [&](Image &image) {
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    // a pixel the coarse passes haven't reached shows the traced one above-left of it
+                    int x = i, y = j;
+                    for (int step = 2; step <= 8 && film.getNumSamples(x, y) == 0; step *= 2) {
+                        x = i - i % step;
+                        y = j - j % step;
+                    }
+                    if (film.getNumSamples(x, y) == 0) {
+                        image.SetPixel(i, j, scene->getBackgroundColor());
+                    } else {
+                        image.SetPixel(i, j, filter != NULL ? filter->getColor(x, y, film) : film.getFirstColor(x, y));
+                    }
+                }
+            }
+        };
+
+        const int tile_size = 16;
+        int tiles_x = (width + tile_size - 1) / tile_size;
+        int tiles_y = (height + tile_size - 1) / tile_size;
+        vector<char> done(tiles_x * tiles_y, 0);
+        RenderState state = {&film, &depthImage, &normalsImage, &cost, 0, &done};
+
+        // the key reads every file of the scene, only worth it for a checkpoint
+        Checkpoint checkpoint(checkpoint_file, checkpoint_file != NULL ? renderSettings() ^ filterSettings() : 0);
+        if (resume && checkpoint.load(state)) {
+            printf("progressive: resuming %s in pass %d of %d\n", checkpoint_file, state.pass + 1, num_passes);
+        }
+        auto saveProgress = [&]() {
+            if (output_file != NULL) {
+                develop(outputImage);
+                saveTGA(outputImage, output_file);
+            }
+            if (checkpoint_file != NULL) checkpoint.save(state);
+        };
+
+        int &pass = state.pass;
+        for (; pass < num_passes && !stopped(); pass++) {
+            int step = pass < 4 ? 8 >> pass : 1;
+            int n = pass < 4 ? 0 : pass - 3;
+            atomic<int> remaining(count(done.begin(), done.end(), 0));
+            while (remaining > 0 && !stopped()) {
+                TileScheduler passScheduler(width, height, tile_size);
+                passScheduler.run(num_threads, [&](const TileScheduler::Tile &tile) {
+                    char &tile_done = done[(tile.y0 / tile_size) * tiles_x + tile.x0 / tile_size];
+                    if (tile_done || stopped() || now() >= next_flush) return;
+                    for (int i = tile.x0; i < tile.x1; i++) {
+                        for (int j = tile.y0; j < tile.y1; j++) {
+                            if (i % step != 0 || j % step != 0) continue;
+                            if (n == 0 && step < 8 && i % (2 * step) == 0 && j % (2 * step) == 0) continue;
+                            double start = cost_file != NULL ? costNow() : 0;
+                            Vec2f offset = sampler != NULL ? sampler->getSamplePosition(i, j, n) : Vec2f(0, 0);
+                            Ray ray = camera->generateRay(Vec2f((i + offset.x()) / float(width), (j + offset.y()) / float(height)));
+                            Hit hit(INFINITY, nullptr, Vec3f(0.0, 0.0, 0.0));
+                            Vec3f color = rayTracer->traceRay(ray, camera->getTMin(), 0, 1.0, 1.0, hit);
+                            film.addSample(i, j, offset, color);
+                            if (n == 0) writePixel(i, j, color, hit);
+                            if (cost_file != NULL) cost[j * width + i] += costNow() - start;
+                        }
+                    }
+                    tile_done = 1;
+                    remaining--;
+                    RayStats::flush();
+                });
+                if (now() >= next_flush) {
+                    saveProgress();
+                    next_flush = now() + interval;
+                }
+            }
+            if (remaining > 0) break;
+            fill(done.begin(), done.end(), 0);
+        }
+        if (pass < num_passes && checkpoint_file != NULL) checkpoint.save(state);
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        develop(outputImage);
+        complete = pass == num_passes;
+        if (!complete) {
+            printf("progressive: stopped in pass %d of %d\n", pass + 1, num_passes);
+        } else if (stats) {
+            printf("progressive: all %d passes done\n", num_passes);
+        }
+    } else if (sampler != NULL) {
+        // the samples go to a film and the filter turns them into colors at
+        // the end.  With -adaptive a first pass traces only the pixel centers
+        // and the second samples fully wherever a center differs from its
+        // neighbours in color or in the object it hit.  The samples are
+        // traced one ray at a time, -packets only changes the plain render
+        Film film(width, height, filter);
+        vector<Vec3f> centers(adaptive ? width * height : 0);
+        vector<const Object3D *> objects(adaptive ? width * height : 0);
+        atomic<int> refined(0);
+
+        auto traceSample = [&](int i, int j, const Vec2f &offset, Hit &hit) {
+            Ray ray = camera->generateRay(Vec2f((i + offset.x()) / float(width), (j + offset.y()) / float(height)));
+            Vec3f color = rayTracer->traceRay(ray, camera->getTMin(), 0, 1.0, 1.0, hit);
+            film.addSample(i, j, offset, color);
+            return color;
+        };
+        auto differs = [&](int p, int q) {
+            if (objects[p] != objects[q]) return true;
+            Vec3f d = centers[p] - centers[q];
+            return max(fabs(d.x()), max(fabs(d.y()), fabs(d.z()))) > adaptive_threshold;
+        };
+
+        if (adaptive) {
+            scheduler.run(num_threads, [&](const TileScheduler::Tile &tile) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    for (int j = tile.y0; j < tile.y1; j++) {
+                        double start = cost_file != NULL ? costNow() : 0;
+                        Hit hit(INFINITY, nullptr, Vec3f(0.0, 0.0, 0.0));
+                        Vec3f color = traceSample(i, j, Vec2f(0.5, 0.5), hit);
+                        writePixel(i, j, color, hit);
+                        centers[j * width + i] = color;
+                        objects[j * width + i] = hit.getObject();
+                        if (cost_file != NULL) cost[j * width + i] = costNow() - start;
+                    }
+                }
+                RayStats::flush();
+            });
+        }
+        // every pixel only reads the centers of the first pass, so the
+        // tiles can still go in any order
+        scheduler.run(num_threads, [&](const TileScheduler::Tile &tile) {
+            int tile_refined = 0;
+            for (int i = tile.x0; i < tile.x1; i++) {
+                for (int j = tile.y0; j < tile.y1; j++) {
+                    int p = j * width + i;
+                    if (adaptive) {
+                        if (!((i > 0 && differs(p, p - 1)) || (i + 1 < width && differs(p, p + 1)) ||
+                              (j > 0 && differs(p, p - width)) || (j + 1 < height && differs(p, p + width))))
+                            continue;
+                        tile_refined++;
+                    }
+                    double start = cost_file != NULL ? costNow() : 0;
+                    for (int n = 0; n < sampler->getNumSamples(); n++) {
+                        Hit hit(INFINITY, nullptr, Vec3f(0.0, 0.0, 0.0));
+                        Vec3f color = traceSample(i, j, sampler->getSamplePosition(i, j, n), hit);
+                        if (!adaptive && n == 0) writePixel(i, j, color, hit);
+                    }
+                    if (cost_file != NULL) cost[p] += costNow() - start;
+                }
+            }
+            refined += tile_refined;
+            RayStats::flush();
+        });
 
-    for (int i = 0; i < width; i++) {
         for (int j = 0; j < height; j++) {
-            Ray ray = camera->generateRay(Vec2f(float(i) / float(width), float(j) / float(height)));
-            Hit hit(INFINITY, nullptr, Vec3f(0.0, 0.0, 0.0));
-
-            Vec3f pixel_color = rayTracer.traceRay(ray, camera->getTMin(), 0, 1.0, 1.0, hit);
-            outputImage.SetPixel(i, j, pixel_color);
-
-            Vec3f normal = hit.getNormal();
-            normalsImage.SetPixel(i, j, Vec3f(fabs(normal.x()), fabs(normal.y()), fabs(normal.z())));
-            float t = hit.getT();
-            if (t > depth_max)
-                t = depth_max;
-            if (t < depth_min)
-                t = depth_min;
-            t = (depth_max - t) / (depth_max - depth_min);
-            depthImage.SetPixel(i, j, Vec3f(t, t, t));
+            for (int i = 0; i < width; i++) {
+                outputImage.SetPixel(i, j, filter->getColor(i, j, film));
+            }
         }
+        if (stats && adaptive) {
+            printf("adaptive: %d of %d pixels refined (%.2f%%)\n", int(refined), width * height,
+                   100.0 * refined / (width * height));
+        }
+    } else {
+        // every pixel is traced independently, so the tiles can be
+        // handed out in any order and still produce the same image
+        scheduler.run(num_threads, [&](const TileScheduler::Tile &tile) {
+            if (packets) {
+                // PACKET_WIDTH x PACKET_HEIGHT blocks, lanes past the tile edge are switched off
+                for (int j0 = tile.y0; j0 < tile.y1; j0 += PACKET_HEIGHT) {
+                    for (int i0 = tile.x0; i0 < tile.x1; i0 += PACKET_WIDTH) {
+                        Vec2f points[SIMD_WIDTH];
+                        HitPacket hits;
+                        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                            int i = i0 + lane % PACKET_WIDTH;
+                            int j = j0 + lane / PACKET_WIDTH;
+                            points[lane] = Vec2f(float(i) / float(width), float(j) / float(height));
+                            if (i >= tile.x1 || j >= tile.y1) hits.disableLane(lane);
+                        }
+                        double start = cost_file != NULL ? costNow() : 0;
+                        RayPacket packet;
+                        camera->generateRayPacket(points, packet);
+
+                        Vec3f colors[SIMD_WIDTH];
+                        rayTracer->tracePacket(packet, camera->getTMin(), hits, colors);
+                        // the lanes share the packet's cost evenly
+                        int lanes = 0;
+                        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                            lanes += hits.isEnabled(lane);
+                        }
+                        double lane_cost = cost_file != NULL ? (costNow() - start) / lanes : 0;
+                        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                            if (!hits.isEnabled(lane)) continue;
+                            int i = i0 + lane % PACKET_WIDTH;
+                            int j = j0 + lane / PACKET_WIDTH;
+                            writePixel(i, j, colors[lane], hits.getHit(lane, packet.getRay(lane)));
+                            if (cost_file != NULL) cost[j * width + i] = lane_cost;
+                        }
+                    }
+                }
+                RayStats::flush();
+                return;
+            }
+            for (int i = tile.x0; i < tile.x1; i++) {
+                for (int j = tile.y0; j < tile.y1; j++) {
+                    double start = cost_file != NULL ? costNow() : 0;
+                    Ray ray = camera->generateRay(Vec2f(float(i) / float(width), float(j) / float(height)));
+                    Hit hit(INFINITY, nullptr, Vec3f(0.0, 0.0, 0.0));
+
+                    Vec3f pixel_color = rayTracer->traceRay(ray, camera->getTMin(), 0, 1.0, 1.0, hit);
+                    writePixel(i, j, pixel_color, hit);
+                    if (cost_file != NULL) cost[j * width + i] = costNow() - start;
+                }
+            }
+            RayStats::flush();
+        });
+    }
+
+    if (stats) {
+        RayStats::total().print(stdout);
+        if (rayTracer->getGrid() != NULL) rayTracer->getGrid()->printStats(stdout);
     }
 
     if (output_file != NULL)
-        outputImage.SaveTGA(output_file);
+        saveTGA(outputImage, output_file);
     if (depth_file != NULL)
         depthImage.SaveTGA(depth_file);
     if (normals_file != NULL)
         normalsImage.SaveTGA(normals_file);
+    if (cost_file != NULL) {
+        // scaled to the most expensive pixel, which is printed for reference
+        double max_cost = 0;
+        for (double c: cost) max_cost = max(max_cost, c);
+        Image costImage(width, height);
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                costImage.SetPixel(i, j, heatColor(max_cost > 0 ? cost[j * width + i] / max_cost : 0));
+            }
+        }
+        costImage.SaveTGA(cost_file);
+        printf("cost: most expensive pixel %.0f %s\n", max_cost, cost_time ? "ns" : "intersection tests");
+    }
+    // the image is written, there is nothing left to resume
+    if (checkpoint_file != NULL && complete)
+        filesystem::remove(checkpoint_file);
     return;
 };
 
 void glRayTracer(float x, float y) {
-    SceneParser parser = SceneParser(input_file);
-    Camera *c = parser.getCamera();
-    RayTracer tracer(&parser, max_bounces, cutoff_weight, shadows, shade_back, gridOrNot, nx, ny, nz, visualize_grid);
-
-    int size = width < height ? width : height;
-    float step = 1.0 / size;
+    Camera *c = scene->getCamera();
     Hit h;
     Ray r = c->generateRay(Vec2f(x, y));
     h.set(INFINITY, NULL, Vec3f(0, 0, 0), Ray());
-    tracer.traceRay(r, c->getTMin(), 0, 1, 1, h);
+    rayTracer->traceRay(r, c->getTMin(), 0, 1, 1, h);
 }
\ No newline at end of file
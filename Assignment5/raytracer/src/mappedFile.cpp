@@ -0,0 +1,50 @@
+#include "mappedFile.h"
+#include <assert.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+MappedFile::MappedFile(const char *filename) : data(nullptr), size(0) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            data = (const char *) mapped;
+            size = info.st_size;
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) munmap((void *) data, size);
+}
+
+#else
+
+MappedFile::MappedFile(const char *filename) : data(nullptr), size(0) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) return;
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *buffer = new char[size];
+    size_t success = fread(buffer, 1, size, file);
+    assert(success == size);
+    fclose(file);
+    data = buffer;
+}
+
+MappedFile::~MappedFile() {
+    delete[] data;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef RAYTRACER_MAPPEDFILE_H
+#define RAYTRACER_MAPPEDFILE_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// ====================================================================
+// ====================================================================
+// A whole file mapped read only into memory (read into it in one go
+// where there is no mmap).  getData() is NULL when the file can't be
+// opened.
+
+class MappedFile {
+public:
+    explicit MappedFile(const char *filename);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *getData() const { return data; }
+
+    size_t getSize() const { return size; }
+
+private:
+    const char *data;
+    size_t size;
+};
+
+// ====================================================================
+// writing files to be mapped: every array starts at a multiple of
+// MAPPED_ALIGN, so it can be used in place
+
+#define MAPPED_ALIGN 64
+
+inline uint64_t mappedAlign(uint64_t offset) {
+    return (offset + MAPPED_ALIGN - 1) / MAPPED_ALIGN * MAPPED_ALIGN;
+}
+
+// pads the file with zeros up to offset and writes bytes there, false
+// if the file didn't take all of them (a full disk, say)
+inline bool writeAt(FILE *file, uint64_t offset, const void *data, size_t bytes) {
+    static const char zeros[MAPPED_ALIGN] = {0};
+    long position = ftell(file);
+    assert(position >= 0 && uint64_t(position) <= offset && offset - position <= MAPPED_ALIGN);
+    size_t padding = offset - position;
+    if (fwrite(zeros, 1, padding, file) != padding) return false;
+    return bytes == 0 || fwrite(data, 1, bytes, file) == bytes;
+}
+
+#endif //RAYTRACER_MAPPEDFILE_H
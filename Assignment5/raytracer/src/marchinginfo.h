@@ -13,7 +13,7 @@ public:
     }
 
     void nextCell() {
-        assert(t_next_x >= 0 && t_next_y >= 0 && t_next_z >= 0);
+        // t_next may be negative for orthographic rays, which start at -INFINITY
         assert(dt_x >= 0 && dt_y >= 0 && dt_z >= 0);
 
         if (t_next_x < t_next_y) {
@@ -51,4 +51,28 @@ public:
     Vec3f normal;
 };
 
+// Per-ray mailbox: remembers which primitives a ray has already been
+// tested against, so an object that spans several cells is intersected
+// once.  It lives on the stack of the ray being traced, which keeps it
+// safe for concurrent rays.  Ids that collide in the table evict each
+// other, which only costs a repeated test.
+class Mailbox {
+public:
+    Mailbox() {
+        for (int i = 0; i < MAILBOX_SIZE; i++) ids[i] = -1;
+    }
+
+    // returns true if id was already tested, and records it otherwise
+    bool testAndSet(int id) {
+        int &slot = ids[id & (MAILBOX_SIZE - 1)];
+        if (slot == id) return true;
+        slot = id;
+        return false;
+    }
+
+private:
+    static const int MAILBOX_SIZE = 64;
+    int ids[MAILBOX_SIZE];
+};
+
 #endif //RAYTRACER_MARCHINGINFO_H
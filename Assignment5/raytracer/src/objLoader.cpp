@@ -0,0 +1,331 @@
+#include "objLoader.h"
+#include "mappedFile.h"
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <charconv>
+#include <thread>
+
+// no point in splitting files smaller than this
+#define OBJ_MIN_CHUNK (4 << 20)
+
+// ====================================================================
+// ====================================================================
+// number parsing
+
+static inline bool isBlank(char c) { return c == ' ' || c == '\t'; }
+
+static inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+static inline void skipBlanks(const char *&p, const char *end) {
+    while (p < end && isBlank(*p)) p++;
+}
+
+// powers of ten that are exact floats
+static const float pow10f[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+
+// the usual short decimals are a float mantissa and a small power of
+// ten, and then one multiply or divide rounds exactly like strtof;
+// anything else goes to from_chars
+static bool parseFloat(const char *&p, const char *end, float &value) {
+    skipBlanks(p, end);
+    if (p < end && *p == '+') p++;
+    const char *q = p;
+    bool negative = q < end && *q == '-';
+    if (negative) q++;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any = false;
+    for (; q < end && isDigit(*q); q++, any = true) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*q - '0');
+            if (mantissa != 0) digits++;
+        } else {
+            exponent++;
+        }
+    }
+    if (q < end && *q == '.') {
+        for (q++; q < end && isDigit(*q); q++, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*q - '0');
+                if (mantissa != 0) digits++;
+                exponent--;
+            }
+        }
+    }
+    if (any && q < end && (*q == 'e' || *q == 'E')) {
+        const char *r = q + 1;
+        bool negative_exponent = r < end && *r == '-';
+        if (r < end && (*r == '-' || *r == '+')) r++;
+        if (r < end && isDigit(*r)) {
+            int e = 0;
+            for (; r < end && isDigit(*r); r++) {
+                if (e < 10000) e = e * 10 + (*r - '0');
+            }
+            exponent += negative_exponent ? -e : e;
+            q = r;
+        }
+    }
+    if (any && mantissa <= (1 << 24) && exponent >= -10 && exponent <= 10) {
+        float f = float(mantissa);
+        f = exponent < 0 ? f / pow10f[-exponent] : f * pow10f[exponent];
+        value = negative ? -f : f;
+        p = q;
+        return true;
+    }
+    std::from_chars_result result = std::from_chars(p, end, value);
+    if (result.ec == std::errc::result_out_of_range) {
+        // value is left alone, round like strtof: too large is infinite,
+        // too small is zero
+        float f = digits + exponent > 0 ? INFINITY : 0.0f;
+        value = negative ? -f : f;
+    } else if (result.ec != std::errc()) {
+        return false;
+    }
+    p = result.ptr;
+    return true;
+}
+
+static bool parseIndex(const char *&p, const char *end, int &value) {
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    if (p == end || !isDigit(*p)) return false;
+    int64_t v = 0;
+    for (; p < end && isDigit(*p); p++) {
+        v = v * 10 + (*p - '0');
+        if (v > INT32_MAX) return false;
+    }
+    value = int(negative ? -v : v);
+    return true;
+}
+
+// ====================================================================
+// ====================================================================
+// one piece of the file, read by its own thread
+
+struct ObjChunk {
+    const char *begin;
+    const char *end;
+    ObjMesh mesh;
+    // positive indices are already zero based file wide, negative ones
+    // can only be made relative to the start of the chunk; these are
+    // the places in faces, face_normals and face_uvs holding such ones
+    vector<size_t> relative[3];
+    // whether faces have normals and uvs, face_normals and face_uvs are
+    // only filled from the first one that does
+    bool normals;
+    bool uvs;
+    // the first line that could not be read
+    const char *error;
+};
+
+struct ObjCorner {
+    int index[3];
+    bool relative[3];
+};
+
+// OBJ indices start at 1, 0 is none
+static bool resolveIndex(int index, int count, int &resolved, bool &relative) {
+    relative = index < 0;
+    resolved = index > 0 ? index - 1 : count + index;
+    return index != 0;
+}
+
+static bool parseFace(const char *&p, const char *end, ObjChunk &chunk, vector<ObjCorner> &corners) {
+    ObjMesh &mesh = chunk.mesh;
+    int counts[3] = {int(mesh.vertices.size()), int(mesh.normals.size()), int(mesh.uvs.size())};
+    corners.clear();
+    while (1) {
+        skipBlanks(p, end);
+        if (p == end || *p == '\n' || *p == '\r' || *p == '#') break;
+        // v, v/vt, v//vn or v/vt/vn
+        int index[3] = {0, 0, 0};
+        if (!parseIndex(p, end, index[0])) return false;
+        if (p < end && *p == '/') {
+            p++;
+            if (p < end && *p != '/' && !parseIndex(p, end, index[2])) return false;
+            if (p < end && *p == '/') {
+                p++;
+                if (!parseIndex(p, end, index[1])) return false;
+            }
+        }
+        if (p < end && !isBlank(*p) && *p != '\n' && *p != '\r') return false;
+        ObjCorner corner;
+        if (!resolveIndex(index[0], counts[0], corner.index[0], corner.relative[0])) return false;
+        for (int k = 1; k < 3; k++) {
+            corner.index[k] = -1;
+            corner.relative[k] = false;
+            if (index[k] != 0) resolveIndex(index[k], counts[k], corner.index[k], corner.relative[k]);
+        }
+        corners.push_back(corner);
+    }
+    if (corners.size() < 3) return false;
+    bool normals = false;
+    bool uvs = false;
+    for (const ObjCorner &corner: corners) {
+        normals |= corner.index[1] >= 0 || corner.relative[1];
+        uvs |= corner.index[2] >= 0 || corner.relative[2];
+    }
+    if (normals && !chunk.normals) mesh.face_normals.resize(mesh.faces.size(), -1);
+    if (uvs && !chunk.uvs) mesh.face_uvs.resize(mesh.faces.size(), -1);
+    chunk.normals |= normals;
+    chunk.uvs |= uvs;
+    vector<int> *arrays[3] = {&mesh.faces, &mesh.face_normals, &mesh.face_uvs};
+    bool used[3] = {true, chunk.normals, chunk.uvs};
+    for (size_t i = 1; i + 1 < corners.size(); i++) {
+        const ObjCorner *fan[3] = {&corners[0], &corners[i], &corners[i + 1]};
+        for (const ObjCorner *corner: fan) {
+            for (int k = 0; k < 3; k++) {
+                if (!used[k]) continue;
+                if (corner->relative[k]) chunk.relative[k].push_back(arrays[k]->size());
+                arrays[k]->push_back(corner->index[k]);
+            }
+        }
+    }
+    return true;
+}
+
+static void parseChunk(ObjChunk *chunk) {
+    const char *p = chunk->begin;
+    const char *end = chunk->end;
+    ObjMesh &mesh = chunk->mesh;
+    vector<ObjCorner> corners;
+    chunk->error = nullptr;
+    chunk->normals = false;
+    chunk->uvs = false;
+    while (p < end) {
+        skipBlanks(p, end);
+        const char *line = p;
+        bool success = true;
+        if (p + 1 < end && p[0] == 'v' && isBlank(p[1])) {
+            float x, y, z;
+            p++;
+            success = parseFloat(p, end, x) && parseFloat(p, end, y) && parseFloat(p, end, z);
+            mesh.vertices.push_back(Vec3f(x, y, z));
+        } else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && isBlank(p[2])) {
+            float x, y, z;
+            p += 2;
+            success = parseFloat(p, end, x) && parseFloat(p, end, y) && parseFloat(p, end, z);
+            mesh.normals.push_back(Vec3f(x, y, z));
+        } else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && isBlank(p[2])) {
+            // the second coordinate is optional
+            float u, v = 0;
+            p += 2;
+            success = parseFloat(p, end, u);
+            skipBlanks(p, end);
+            if (success && p < end && *p != '\n' && *p != '\r') success = parseFloat(p, end, v);
+            mesh.uvs.push_back(Vec2f(u, v));
+        } else if (p + 1 < end && p[0] == 'f' && isBlank(p[1])) {
+            p++;
+            success = parseFace(p, end, *chunk, corners);
+        }
+        if (!success && chunk->error == nullptr) chunk->error = line;
+        // whatever else is on the line is ignored
+        const char *newline = (const char *) memchr(p, '\n', end - p);
+        p = newline == nullptr ? end : newline + 1;
+    }
+}
+
+// ====================================================================
+// ====================================================================
+
+void loadObj(const char *filename, ObjMesh &mesh, int num_threads) {
+    MappedFile file(filename);
+    if (file.getData() == nullptr) {
+        printf("whoops, can't read %s\n", filename);
+        assert(0);
+    }
+    const char *data = file.getData();
+    size_t size = file.getSize();
+    if (num_threads <= 0) num_threads = thread::hardware_concurrency();
+    size_t num_chunks = size / OBJ_MIN_CHUNK;
+    if (num_chunks > size_t(num_threads)) num_chunks = num_threads;
+    if (num_chunks < 1) num_chunks = 1;
+
+    // split at line boundaries
+    vector<ObjChunk> chunks(num_chunks);
+    const char *begin = data;
+    for (size_t c = 0; c < num_chunks; c++) {
+        const char *end = data + size;
+        if (c + 1 < num_chunks) {
+            const char *split = data + size / num_chunks * (c + 1);
+            if (split < begin) split = begin;
+            const char *newline = (const char *) memchr(split, '\n', data + size - split);
+            if (newline != nullptr) end = newline + 1;
+        }
+        chunks[c].begin = begin;
+        chunks[c].end = end;
+        begin = end;
+    }
+    vector<thread> threads;
+    for (size_t c = 1; c < num_chunks; c++) threads.push_back(thread(parseChunk, &chunks[c]));
+    parseChunk(&chunks[0]);
+    for (thread &t: threads) t.join();
+
+    // stitch the chunks together in file order
+    size_t totals[4] = {0, 0, 0, 0};
+    bool normals = false;
+    bool uvs = false;
+    for (ObjChunk &chunk: chunks) {
+        if (chunk.error != nullptr) {
+            const char *newline = (const char *) memchr(chunk.error, '\n', chunk.end - chunk.error);
+            int length = int((newline == nullptr ? chunk.end : newline) - chunk.error);
+            printf("whoops, can't read line '%.*s' of %s\n", length, chunk.error, filename);
+            assert(0);
+        }
+        totals[0] += chunk.mesh.vertices.size();
+        totals[1] += chunk.mesh.normals.size();
+        totals[2] += chunk.mesh.uvs.size();
+        totals[3] += chunk.mesh.faces.size();
+        normals |= chunk.normals;
+        uvs |= chunk.uvs;
+    }
+    assert(totals[0] <= INT32_MAX && totals[3] <= INT32_MAX);
+    mesh.vertices.clear();
+    mesh.normals.clear();
+    mesh.uvs.clear();
+    mesh.vertices.reserve(totals[0]);
+    mesh.normals.reserve(totals[1]);
+    mesh.uvs.reserve(totals[2]);
+    mesh.faces.assign(totals[3], -1);
+    mesh.face_normals.assign(normals ? totals[3] : 0, -1);
+    mesh.face_uvs.assign(uvs ? totals[3] : 0, -1);
+    size_t face_offset = 0;
+    for (ObjChunk &chunk: chunks) {
+        ObjMesh &piece = chunk.mesh;
+        int offsets[3] = {int(mesh.vertices.size()), int(mesh.normals.size()), int(mesh.uvs.size())};
+        vector<int> *from[3] = {&piece.faces, &piece.face_normals, &piece.face_uvs};
+        vector<int> *to[3] = {&mesh.faces, &mesh.face_normals, &mesh.face_uvs};
+        size_t num_indices = piece.faces.size();
+        for (int k = 0; k < 3; k++) {
+            for (size_t i: chunk.relative[k]) (*from[k])[i] += offsets[k];
+            if (!from[k]->empty()) {
+                memcpy(to[k]->data() + face_offset, from[k]->data(), from[k]->size() * sizeof(int));
+            }
+            vector<int>().swap(*from[k]);
+        }
+        face_offset += num_indices;
+        mesh.vertices.insert(mesh.vertices.end(), piece.vertices.begin(), piece.vertices.end());
+        mesh.normals.insert(mesh.normals.end(), piece.normals.begin(), piece.normals.end());
+        mesh.uvs.insert(mesh.uvs.end(), piece.uvs.begin(), piece.uvs.end());
+        vector<Vec3f>().swap(piece.vertices);
+        vector<Vec3f>().swap(piece.normals);
+        vector<Vec2f>().swap(piece.uvs);
+    }
+
+    // -1 is fine for a corner without a normal or uv, not for a vertex
+    int counts[3] = {int(mesh.vertices.size()), int(mesh.normals.size()), int(mesh.uvs.size())};
+    vector<int> *arrays[3] = {&mesh.faces, &mesh.face_normals, &mesh.face_uvs};
+    for (int k = 0; k < 3; k++) {
+        int lowest = k == 0 ? 0 : -1;
+        for (int index: *arrays[k]) {
+            if (index < lowest || index >= counts[k]) {
+                printf("whoops, face index %d out of range in %s\n", index + 1, filename);
+                assert(0);
+            }
+        }
+    }
+}
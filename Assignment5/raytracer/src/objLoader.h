@@ -0,0 +1,34 @@
+#ifndef RAYTRACER_OBJLOADER_H
+#define RAYTRACER_OBJLOADER_H
+
+#include <vector>
+#include "LAlib/vectors.h"
+
+using namespace std;
+
+// ====================================================================
+// ====================================================================
+// A Wavefront OBJ file: v, vn and vt lines and f lines with any of the
+// v, v/vt, v//vn and v/vt/vn forms.  Negative indices count back from
+// the last element read, and polygons are split into fans.  Every
+// other line (groups, materials, ...) is skipped.
+
+struct ObjMesh {
+    vector<Vec3f> vertices;
+    vector<Vec3f> normals;
+    vector<Vec2f> uvs;
+    // three zero based indices per triangle
+    vector<int> faces;
+    // parallel to faces, -1 where a corner had none; empty when no
+    // face of the file has any
+    vector<int> face_normals;
+    vector<int> face_uvs;
+
+    int getNumTriangles() const { return int(faces.size() / 3); }
+};
+
+// big files are split at line boundaries and the pieces read by
+// num_threads threads (0: one per core)
+void loadObj(const char *filename, ObjMesh &mesh, int num_threads = 0);
+
+#endif //RAYTRACER_OBJLOADER_H
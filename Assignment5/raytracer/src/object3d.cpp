@@ -1,14 +1,29 @@
 #include "object3d.h"
+#include "bvh.h"
 #include <GL/freeglut.h>
 #include <vector>
 
 #define epsilon 1e-4
 
+void Object3D::insertIntoBVH(BVH *bvh) {
+    bvh->insertIntoThis(this);
+}
+
+void Object3D::intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const {
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        if (!h.isEnabled(lane)) continue;
+        Ray ray = r.getRay(lane);
+        Hit hit = h.getHit(lane, ray);
+        if (intersect(ray, hit, tmin)) h.setHit(lane, hit);
+    }
+}
+
 /*
  * GROUP
  */
 
-bool Group::intersect(const Ray &r, Hit &h, float tmin) {
+bool Group::intersect(const Ray &r, Hit &h, float tmin) const {
+    RAYSTAT_ADD(group_tests, num_objects);
     bool flag = false;
     for (int i = 0; i < num_objects; i++) {
         if (objects[i]->intersect(r, h, tmin))
@@ -29,11 +44,18 @@ void Group::insertIntoGrid(Grid *g, Matrix *m) {
     }
 }
 
+void Group::insertIntoBVH(BVH *bvh) {
+    for (int i = 0; i < num_objects; i++) {
+        objects[i]->insertIntoBVH(bvh);
+    }
+}
+
 /*
  * SPHERE
  */
 
-bool Sphere::intersect(const Ray &r, Hit &h, float tmin) {
+bool Sphere::intersectT(const Ray &r, float tmin, float tmax, float &t) const {
+    RAYSTAT(sphere_tests);
     Vec3f relative_origin = r.getOrigin() - center;
     float a = r.getDirection().Length() * r.getDirection().Length();
     float b = 2 * relative_origin.Dot3(r.getDirection());
@@ -43,19 +65,53 @@ bool Sphere::intersect(const Ray &r, Hit &h, float tmin) {
     delta = sqrt(delta);
     float t1 = (-b + delta) / (2 * a), t2 = (-b - delta) / (2 * a);
 
-    if (t2 > tmin && t2 < h.getT()) {
-        Vec3f normal = relative_origin + t2 * r.getDirection();
-        normal.Normalize();
-        h.set(t2, material, normal, r);
+    if (t2 > tmin && t2 < tmax) {
+        t = t2;
         return true;
-    } else if (t1 > tmin && t1 < h.getT()) {
-        Vec3f normal = relative_origin + t1 * r.getDirection();
-        normal.Normalize();
-        h.set(t1, material, normal, r);
+    } else if (t1 > tmin && t1 < tmax) {
+        t = t1;
         return true;
     } else return false;
 }
 
+bool Sphere::intersect(const Ray &r, Hit &h, float tmin) const {
+    float t;
+    if (!intersectT(r, tmin, h.getT(), t)) return false;
+    Vec3f normal = r.getOrigin() - center + t * r.getDirection();
+    normal.Normalize();
+    h.set(t, material, normal, r, this);
+    return true;
+}
+
+bool Sphere::intersectShadowRay(const Ray &r, Hit &h, float tmin) const {
+    float t;
+    return intersectT(r, tmin, h.getT(), t);
+}
+
+void Sphere::intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const {
+    RAYSTAT_ADD(sphere_tests, SIMD_WIDTH);
+    SimdVec3f relative_origin = r.getOrigin() - SimdVec3f(center.x(), center.y(), center.z());
+    const SimdVec3f &rd = r.getDirection();
+    SimdFloat a = rd.Dot3(rd);
+    SimdFloat b = SimdFloat(2) * relative_origin.Dot3(rd);
+    SimdFloat c = relative_origin.Dot3(relative_origin) - SimdFloat(radius * radius);
+    SimdFloat delta = b * b - SimdFloat(4) * a * c;
+    SimdMask valid = delta >= SimdFloat(0);
+    if (simdBits(valid) == 0) return;
+    delta = simdSqrt(simdMax(delta, SimdFloat(0)));
+    SimdFloat t1 = (SimdFloat(0) - b + delta) / (SimdFloat(2) * a);
+    SimdFloat t2 = (SimdFloat(0) - b - delta) / (SimdFloat(2) * a);
+
+    // nearer root first, as in the scalar kernel
+    SimdFloat t_min(tmin), t_max = h.getT();
+    SimdMask near = (t2 > t_min) & (t2 < t_max);
+    SimdMask far = (t1 > t_min) & (t1 < t_max);
+    SimdFloat t = simdSelect(near, t2, t1);
+    SimdVec3f normal = relative_origin + rd * t;
+    normal = normal * (SimdFloat(1) / simdSqrt(normal.Dot3(normal)));
+    h.update(valid & (near | far), t, normal, material);
+}
+
 extern int thetaStep;
 extern int phiStep;
 extern bool gouraud;
@@ -106,35 +162,15 @@ void Sphere::paint() const {
 }
 
 void Sphere::insertIntoGrid(Grid *g, Matrix *m) {
-    //TODO:debug
-    //FIXME:m
-    BoundingBox *bb = g->getBoundingBox();
-    int nx = g->getGrid().x();
-    int ny = g->getGrid().y();
-    int nz = g->getGrid().z();
-    Vec3f gridLong = bb->getMax() - bb->getMin();
-    float dx = gridLong.x() / float(nx);
-    float dy = gridLong.y() / float(ny);
-    float dz = gridLong.z() / float(nz);
-    float diag = sqrt(dx * dx + dy * dy + dz * dz);
-    for (int i = 0; i < nx; i++) {
-        for (int j = 0; j < ny; j++) {
-            for (int k = 0; k < nz; k++) {
-                Vec3f centerOfVoxel = Vec3f((i + 0.5) * dx, (j + 0.5) * dy, (k + 0.5) * dz) + bb->getMin();
-                if ((centerOfVoxel - center).Length() <= radius + 0.5 * diag) {
-                    g->insertIntoThis(i * ny * nz + j * nz + k, this);
-                }
-            }
-        }
-    }
-    return;
+    g->insertSphere(center, radius, this);
 }
 
 /*
  * PLANE
  */
 
-bool Plane::intersect(const Ray &r, Hit &h, float tmin) {
+bool Plane::intersect(const Ray &r, Hit &h, float tmin) const {
+    RAYSTAT(plane_tests);
     Vec3f ro = r.getOrigin();
     Vec3f rd = r.getDirection();
     float denom = normal.Dot3(rd);
@@ -142,12 +178,29 @@ bool Plane::intersect(const Ray &r, Hit &h, float tmin) {
         return false;
     float t = (d - normal.Dot3(ro)) / denom;
     if (t > tmin && t < h.getT()) {
-        h.set(t, material, normal, r);
+        h.set(t, material, normal, r, this);
         return true;
     }
     return false;
 }
 
+void Plane::intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const {
+    RAYSTAT_ADD(plane_tests, SIMD_WIDTH);
+    SimdVec3f n(normal.x(), normal.y(), normal.z());
+    // a ray parallel to the plane gets t = inf or NaN, which fails both tests
+    SimdFloat t = (SimdFloat(d) - n.Dot3(r.getOrigin())) / n.Dot3(r.getDirection());
+    h.update((t > SimdFloat(tmin)) & (t < h.getT()), t, n, material);
+}
+
+bool Plane::intersectShadowRay(const Ray &r, Hit &h, float tmin) const {
+    RAYSTAT(plane_tests);
+    float denom = normal.Dot3(r.getDirection());
+    if (denom == 0)
+        return false;
+    float t = (d - normal.Dot3(r.getOrigin())) / denom;
+    return t > tmin && t < h.getT();
+}
+
 void Plane::paint() const {
     const int INF = 10000;
 
@@ -186,6 +239,9 @@ void Plane::paint() const {
 
 //TODO:不知道咋写，只能遍历计算了
 void Plane::insertIntoGrid(Grid *g, Matrix *m) {
+    // the plane extends past the grid, so rays must always test it;
+    // the cells near it are still filled for the grid visualization
+    g->insertUnbounded(this);
     BoundingBox *bb = g->getBoundingBox();
     int nx = g->getGrid().x();
     int ny = g->getGrid().y();
@@ -213,37 +269,97 @@ void Plane::insertIntoGrid(Grid *g, Matrix *m) {
  * TRIANGLE
  */
 
-bool Triangle::intersect(const Ray &r, Hit &h, float tmin) {
-    Vec3f Ro = r.getOrigin();
-    Vec3f Rd = r.getDirection();
-    float A =
-            det3x3(
-                    a.x() - b.x(), a.x() - c.x(), Rd.x(),
-                    a.y() - b.y(), a.y() - c.y(), Rd.y(),
-                    a.z() - b.z(), a.z() - c.z(), Rd.z());
-    float beta =
-            det3x3(
-                    a.x() - Ro.x(), a.x() - c.x(), Rd.x(),
-                    a.y() - Ro.y(), a.y() - c.y(), Rd.y(),
-                    a.z() - Ro.z(), a.z() - c.z(), Rd.z()) /
-            A;
-    float gamma =
-            det3x3(a.x() - b.x(), a.x() - Ro.x(), Rd.x(),
-                   a.y() - b.y(), a.y() - Ro.y(), Rd.y(),
-                   a.z() - b.z(), a.z() - Ro.z(), Rd.z()) /
-            A;
+// t in (tmin, tmax) of the hit with the triangle a, b, c given as a
+// and its edges e1 = a - b, e2 = a - c, and the barycentric coordinates
+// of b and c at the hit; shared by Triangle and TriangleMesh
+static inline bool intersectTriangle(const Vec3f &a, const Vec3f &e1, const Vec3f &e2, const Ray &r,
+                                     float tmin, float tmax, float &t, float &beta, float &gamma) {
+    RAYSTAT(triangle_tests);
+    const Vec3f &Ro = r.getOrigin();
+    const Vec3f &Rd = r.getDirection();
+    Vec3f s = a - Ro;
+#if TRIANGLE_MOLLER_TRUMBORE
+    // the determinants of the Cramer's rule path as triple products:
+    // A = e1.(e2 x d), beta = s.(e2 x d) / A, gamma = d.(e1 x s) / A,
+    // t = s.(e1 x e2) / A = -e2.(e1 x s) / A
+    Vec3f p;
+    Vec3f::Cross3(p, e2, Rd);
+    float A = e1.Dot3(p);
+    if (A == 0) return false;
+    float inv = 1 / A;
+    beta = s.Dot3(p) * inv;
+    // negated so that NaNs are rejected too
+    if (!(beta > 0 && beta <= 1 + epsilon)) return false;
+    Vec3f q;
+    Vec3f::Cross3(q, e1, s);
+    gamma = Rd.Dot3(q) * inv;
+    if (!(gamma > 0 && beta + gamma <= 1 + epsilon)) return false;
+    t = -e2.Dot3(q) * inv;
+    return t > tmin && t < tmax;
+#else
+    float A = det3x3(e1.x(), e2.x(), Rd.x(),
+                     e1.y(), e2.y(), Rd.y(),
+                     e1.z(), e2.z(), Rd.z());
+    beta = det3x3(s.x(), e2.x(), Rd.x(),
+                        s.y(), e2.y(), Rd.y(),
+                        s.z(), e2.z(), Rd.z()) / A;
+    gamma = det3x3(e1.x(), s.x(), Rd.x(),
+                         e1.y(), s.y(), Rd.y(),
+                         e1.z(), s.z(), Rd.z()) / A;
     if (beta + gamma <= 1 + epsilon && beta > 0 && gamma > 0) {
-        float t =
-                det3x3(a.x() - b.x(), a.x() - c.x(), a.x() - Ro.x(),
-                       a.y() - b.y(), a.y() - c.y(), a.y() - Ro.y(),
-                       a.z() - b.z(), a.z() - c.z(), a.z() - Ro.z()) /
-                A;
-        if (t > tmin && t < h.getT()) {
-            h.set(t, material, normal, r);
-            return true;
-        }
+        t = det3x3(e1.x(), e2.x(), s.x(),
+                   e1.y(), e2.y(), s.y(),
+                   e1.z(), e2.z(), s.z()) / A;
+        return t > tmin && t < tmax;
     }
     return false;
+#endif
+}
+
+bool Triangle::intersectT(const Ray &r, float tmin, float tmax, float &t) const {
+    float beta, gamma;
+    return intersectTriangle(a, e1, e2, r, tmin, tmax, t, beta, gamma);
+}
+
+bool Triangle::intersect(const Ray &r, Hit &h, float tmin) const {
+    float t;
+    if (!intersectT(r, tmin, h.getT(), t)) return false;
+    h.set(t, material, normal, r, this);
+    return true;
+}
+
+// intersectTriangle for a whole packet, always in the Moller-Trumbore
+// form so the parts that only depend on the triangle are shared by all
+// lanes; gamma and t are only computed if some lane passes beta
+static SimdMask intersectTrianglePacket(const Vec3f &a, const Vec3f &e1, const Vec3f &e2, const RayPacket &r,
+                                        float tmin, SimdFloat tmax, SimdFloat &t, SimdFloat &beta, SimdFloat &gamma) {
+    RAYSTAT_ADD(triangle_tests, SIMD_WIDTH);
+    SimdVec3f E1(e1.x(), e1.y(), e1.z());
+    SimdVec3f E2(e2.x(), e2.y(), e2.z());
+    SimdVec3f s = SimdVec3f(a.x(), a.y(), a.z()) - r.getOrigin();
+    const SimdVec3f &rd = r.getDirection();
+    SimdVec3f p = SimdVec3f::Cross3(E2, rd);
+    SimdFloat inv = SimdFloat(1) / E1.Dot3(p);
+    beta = s.Dot3(p) * inv;
+    SimdMask mask = (beta > SimdFloat(0)) & (beta <= SimdFloat(1 + epsilon));
+    if (simdBits(mask) == 0) return mask;
+    SimdVec3f q = SimdVec3f::Cross3(E1, s);
+    gamma = rd.Dot3(q) * inv;
+    mask = mask & (gamma > SimdFloat(0)) & (beta + gamma <= SimdFloat(1 + epsilon));
+    if (simdBits(mask) == 0) return mask;
+    t = SimdFloat(0) - E2.Dot3(q) * inv;
+    return mask & (t > SimdFloat(tmin)) & (t < tmax);
+}
+
+void Triangle::intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const {
+    SimdFloat t, beta, gamma;
+    SimdMask mask = intersectTrianglePacket(a, e1, e2, r, tmin, h.getT(), t, beta, gamma);
+    h.update(mask, t, SimdVec3f(normal.x(), normal.y(), normal.z()), material);
+}
+
+bool Triangle::intersectShadowRay(const Ray &r, Hit &h, float tmin) const {
+    float t;
+    return intersectT(r, tmin, h.getT(), t);
 }
 
 void Triangle::paint() const {
@@ -257,73 +373,305 @@ void Triangle::paint() const {
 }
 
 void Triangle::insertIntoGrid(Grid *g, Matrix *m) {
-    Vec3f tri_min = boundingBox->getMin();
-    Vec3f tri_max = boundingBox->getMax();
+    g->insertTriangle(a, b, c, this);
+}
 
-    Vec3f grid_min = g->getBoundingBox()->getMin();
-    Vec3f grid_max = g->getBoundingBox()->getMax();
+/*
+ * TRIANGLE MESH
+ */
 
-    int nx = g->getGrid().x();
-    int ny = g->getGrid().y();
-    int nz = g->getGrid().z();
+TriangleMesh::TriangleMesh(vector<Vec3f> &_vertices, vector<int> &_faces, Material *_material) {
+    material = _material;
+    own_vertices.swap(_vertices);
+    own_faces.swap(_faces);
+    int n = own_faces.size() / 3;
+    assert(3 * n == int(own_faces.size()));
+
+    own_edges.resize(6 * n);
+    for (int f = 0; f < n; f++) {
+        Vec3f a = own_vertices[own_faces[3 * f]];
+        Vec3f e1 = a - own_vertices[own_faces[3 * f + 1]];
+        Vec3f e2 = a - own_vertices[own_faces[3 * f + 2]];
+        for (int k = 0; k < 3; k++) {
+            own_edges[k * n + f] = e1[k];
+            own_edges[(3 + k) * n + f] = e2[k];
+        }
+    }
 
-    float cell_x = (grid_max - grid_min).x() / nx;
-    float cell_y = (grid_max - grid_min).y() / ny;
-    float cell_z = (grid_max - grid_min).z() / nz;
-
-    int start_i = fabs(tri_min.x() - grid_min.x()) * (1 / cell_x);
-    int start_j = fabs(tri_min.y() - grid_min.y()) * (1 / cell_y);
-    int start_k = fabs(tri_min.z() - grid_min.z()) * (1 / cell_z);
-    int end_i = fabs(tri_max.x() - grid_min.x()) * (1 / cell_x);
-    int end_j = fabs(tri_max.y() - grid_min.y()) * (1 / cell_y);
-    int end_k = fabs(tri_max.z() - grid_min.z()) * (1 / cell_z);
-
-    if (start_i == end_i)end_i++;
-    if (start_j == end_j)end_j++;
-    if (start_k == end_k)end_k++;
-    if (start_i > end_i) swap(start_i, end_i);
-    if (start_j > end_j) swap(start_j, end_j);
-    if (start_k > end_k) swap(start_k, end_k);
-
-    assert(start_i >= 0 && start_i <= nx &&
-           start_j >= 0 && start_j <= ny &&
-           start_k >= 0 && start_k <= nz);
-
-    for (int i = start_i; i < end_i; i++) {
-        for (int j = start_j; j < end_j; j++) {
-            for (int k = start_k; k < end_k; k++) {
-                g->insertIntoThis(i * ny * nz + j * nz + k, this);
+    TriangleMeshData mesh;
+    mesh.num_vertices = own_vertices.size();
+    mesh.num_faces = n;
+    mesh.vertices = own_vertices.data();
+    mesh.faces = own_faces.data();
+    mesh.edges = own_edges.data();
+    mesh.num_normals = 0;
+    mesh.normals = nullptr;
+    mesh.normal_faces = nullptr;
+    BoundingBox bounds(Vec3f(INFINITY, INFINITY, INFINITY), Vec3f(-INFINITY, -INFINITY, -INFINITY));
+    for (const Vec3f &v: own_vertices) {
+        bounds.Extend(v);
+    }
+    mesh.min = bounds.getMin();
+    mesh.max = bounds.getMax();
+    setData(mesh);
+}
+
+TriangleMesh::TriangleMesh(const TriangleMeshData &_data, Material *_material) {
+    material = _material;
+    setData(_data);
+}
+
+void TriangleMesh::setData(const TriangleMeshData &_data) {
+    data = _data;
+    num_faces = data.num_faces;
+    vertices = data.vertices;
+    faces = data.faces;
+    e1x = data.edges;
+    e1y = e1x + num_faces;
+    e1z = e1y + num_faces;
+    e2x = e1z + num_faces;
+    e2y = e2x + num_faces;
+    e2z = e2y + num_faces;
+    normals = data.normals;
+    normal_faces = data.normal_faces;
+    boundingBox = new BoundingBox(data.min, data.max);
+}
+
+void TriangleMesh::setNormals(vector<Vec3f> &_normals, vector<int> &_normal_faces) {
+    assert(!own_faces.empty() && _normal_faces.size() == own_faces.size());
+    // exporters mostly write one normal per vertex, then the corners
+    // don't need indices of their own
+    vector<int> vertex_normals(data.num_vertices, -1);
+    bool per_vertex = true;
+    for (size_t i = 0; per_vertex && i < own_faces.size(); i++) {
+        int &normal = vertex_normals[own_faces[i]];
+        per_vertex = normal < 0 || normal == _normal_faces[i];
+        normal = _normal_faces[i];
+    }
+    if (per_vertex) {
+        own_normals.resize(data.num_vertices);
+        for (int v = 0; v < data.num_vertices; v++) {
+            // vertices no face uses keep a zero normal
+            if (vertex_normals[v] >= 0) own_normals[v] = _normals[vertex_normals[v]];
+        }
+        own_normal_faces.clear();
+    } else {
+        own_normals.swap(_normals);
+        own_normal_faces.swap(_normal_faces);
+    }
+    for (Vec3f &normal: own_normals) {
+        if (normal.Length() > 0) normal.Normalize();
+    }
+    data.num_normals = own_normals.size();
+    data.normals = normals = own_normals.data();
+    data.normal_faces = normal_faces = own_normal_faces.empty() ? nullptr : own_normal_faces.data();
+}
+
+void TriangleMesh::smoothNormals() {
+    assert(!own_faces.empty());
+    own_normals.assign(data.num_vertices, Vec3f(0, 0, 0));
+    own_normal_faces.clear();
+    for (int f = 0; f < num_faces; f++) {
+        // e1 x e2 is twice the area of the face long
+        Vec3f normal;
+        Vec3f::Cross3(normal, Vec3f(e1x[f], e1y[f], e1z[f]), Vec3f(e2x[f], e2y[f], e2z[f]));
+        for (int corner = 0; corner < 3; corner++) {
+            own_normals[faces[3 * f + corner]] += normal;
+        }
+    }
+    for (Vec3f &normal: own_normals) {
+        if (normal.Length() > 0) normal.Normalize();
+    }
+    data.num_normals = own_normals.size();
+    data.normals = normals = own_normals.data();
+    data.normal_faces = normal_faces = nullptr;
+}
+
+bool TriangleMesh::intersectT(int face, const Ray &r, float tmin, float tmax, float &t) const {
+    Vec3f e1(e1x[face], e1y[face], e1z[face]);
+    Vec3f e2(e2x[face], e2y[face], e2z[face]);
+    float beta, gamma;
+    return intersectTriangle(getVertex(face, 0), e1, e2, r, tmin, tmax, t, beta, gamma);
+}
+
+Vec3f TriangleMesh::getNormal(int face) const {
+    // (b - a) x (c - a) = e1 x e2
+    Vec3f normal;
+    Vec3f::Cross3(normal, Vec3f(e1x[face], e1y[face], e1z[face]), Vec3f(e2x[face], e2y[face], e2z[face]));
+    normal.Normalize();
+    return normal;
+}
+
+Vec3f TriangleMesh::getNormal(int face, float beta, float gamma) const {
+    if (normals == nullptr) return getNormal(face);
+    Vec3f normal = (1 - beta - gamma) * getVertexNormal(face, 0) + beta * getVertexNormal(face, 1) +
+                   gamma * getVertexNormal(face, 2);
+    float length = normal.Length();
+    // opposite normals at the corners can cancel out
+    if (!(length > 0)) return getNormal(face);
+    return normal * (1 / length);
+}
+
+BoundingBox TriangleMesh::getFaceBoundingBox(int face) {
+    BoundingBox bb(getVertex(face, 0), getVertex(face, 0));
+    bb.Extend(getVertex(face, 1));
+    bb.Extend(getVertex(face, 2));
+    return bb;
+}
+
+bool TriangleMesh::intersectFace(int face, const Ray &r, Hit &h, float tmin) const {
+    float t, beta, gamma;
+    Vec3f e1(e1x[face], e1y[face], e1z[face]);
+    Vec3f e2(e2x[face], e2y[face], e2z[face]);
+    if (!intersectTriangle(getVertex(face, 0), e1, e2, r, tmin, h.getT(), t, beta, gamma)) return false;
+    h.set(t, material, getNormal(face, beta, gamma), r, this);
+    return true;
+}
+
+bool TriangleMesh::intersectFaceShadowRay(int face, const Ray &r, Hit &h, float tmin) const {
+    float t;
+    return intersectT(face, r, tmin, h.getT(), t);
+}
+
+void TriangleMesh::intersectFacePacket(int face, const RayPacket &r, HitPacket &h, float tmin) const {
+    SimdFloat t, beta, gamma;
+    Vec3f e1(e1x[face], e1y[face], e1z[face]);
+    Vec3f e2(e2x[face], e2y[face], e2z[face]);
+    SimdMask mask = intersectTrianglePacket(getVertex(face, 0), e1, e2, r, tmin, h.getT(), t, beta, gamma);
+    if (simdBits(mask) == 0) return;
+    if (normals == nullptr) {
+        Vec3f normal = getNormal(face);
+        h.update(mask, t, SimdVec3f(normal.x(), normal.y(), normal.z()), material);
+        return;
+    }
+    SimdVec3f normal(SimdFloat(0), SimdFloat(0), SimdFloat(0));
+    SimdFloat weights[3] = {SimdFloat(1) - beta - gamma, beta, gamma};
+    for (int corner = 0; corner < 3; corner++) {
+        Vec3f n = getVertexNormal(face, corner);
+        normal = normal + SimdVec3f(n.x(), n.y(), n.z()) * weights[corner];
+    }
+    SimdFloat length2 = normal.Dot3(normal);
+    normal = normal * (SimdFloat(1) / simdSqrt(length2));
+    // lanes where the corner normals cancel out take the face normal
+    SimdMask valid = length2 > SimdFloat(0);
+    if (simdBits(valid & mask) != simdBits(mask)) {
+        Vec3f n = getNormal(face);
+        normal.x = simdSelect(valid, normal.x, SimdFloat(n.x()));
+        normal.y = simdSelect(valid, normal.y, SimdFloat(n.y()));
+        normal.z = simdSelect(valid, normal.z, SimdFloat(n.z()));
+    }
+    h.update(mask, t, normal, material);
+}
+
+// without an accelerator every face is tested, as a Group of Triangles did
+bool TriangleMesh::intersect(const Ray &r, Hit &h, float tmin) const {
+    int closest = -1;
+    float t, beta, gamma, tmax = h.getT();
+    float closest_beta = 0, closest_gamma = 0;
+    for (int f = 0; f < num_faces; f++) {
+        Vec3f e1(e1x[f], e1y[f], e1z[f]);
+        Vec3f e2(e2x[f], e2y[f], e2z[f]);
+        if (intersectTriangle(getVertex(f, 0), e1, e2, r, tmin, tmax, t, beta, gamma)) {
+            tmax = t;
+            closest = f;
+            closest_beta = beta;
+            closest_gamma = gamma;
+        }
+    }
+    if (closest < 0) return false;
+    h.set(tmax, material, getNormal(closest, closest_beta, closest_gamma), r, this);
+    return true;
+}
+
+bool TriangleMesh::intersectShadowRay(const Ray &r, Hit &h, float tmin) const {
+    float t;
+    for (int f = 0; f < num_faces; f++) {
+        if (intersectT(f, r, tmin, h.getT(), t)) return true;
+    }
+    return false;
+}
+
+void TriangleMesh::intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const {
+    for (int f = 0; f < num_faces; f++) {
+        intersectFacePacket(f, r, h, tmin);
+    }
+}
+
+void TriangleMesh::paint() const {
+    material->glSetMaterial();
+    glBegin(GL_TRIANGLES);
+    for (int f = 0; f < num_faces; f++) {
+        Vec3f normal = getNormal(f);
+        glNormal3f(normal.x(), normal.y(), normal.z());
+        for (int corner = 0; corner < 3; corner++) {
+            if (normals != nullptr) {
+                Vec3f n = getVertexNormal(f, corner);
+                glNormal3f(n.x(), n.y(), n.z());
             }
+            Vec3f v = getVertex(f, corner);
+            glVertex3f(v.x(), v.y(), v.z());
         }
     }
+    glEnd();
+}
+
+void TriangleMesh::insertIntoGrid(Grid *g, Matrix *) {
+    for (int f = 0; f < num_faces; f++) {
+        g->insertTriangle(getVertex(f, 0), getVertex(f, 1), getVertex(f, 2), this, f);
+    }
+}
+
+void TriangleMesh::insertFaceIntoGrid(int face, Grid *g) {
+    g->insertTriangle(getVertex(face, 0), getVertex(face, 1), getVertex(face, 2), this, face);
+}
+
+void TriangleMesh::insertIntoBVH(BVH *bvh) {
+    for (int f = 0; f < num_faces; f++) {
+        BoundingBox bb = getFaceBoundingBox(f);
+        bvh->insertFace(this, f, &bb);
+    }
 }
 
 /*
  * TRANSFORM
  */
 
-bool Transform::intersect(const Ray &r, Hit &h, float tmin) {
+Ray Transform::toObjectSpace(const Ray &r) const {
     Vec3f origin = r.getOrigin();
     Vec3f direction = r.getDirection();
+    if (affine) {
+        inverse.TransformAffine(origin);
+        inverse.TransformDirectionAffine(direction);
+    } else {
+        inverse.Transform(origin);
+        inverse.TransformDirection(direction);
+    }
+    return Ray(origin, direction);
+}
 
-    Matrix invMatrix = matrix;
-    if (invMatrix.Inverse()) {
-        invMatrix.Transform(origin);
-        invMatrix.TransformDirection(direction);
-        Ray invRay(origin, direction);
-        if (object->intersect(invRay, h, tmin)) {
-            Matrix invMatrixT = invMatrix;
-            invMatrixT.Transpose();
-            Vec3f normal = h.getNormal();
-            invMatrixT.TransformDirection(normal);
-            normal.Normalize();
-            h.set(h.getT(), h.getMaterial(), normal, invRay);
-            return true;
-        }
+bool Transform::intersect(const Ray &r, Hit &h, float tmin) const {
+    if (!invertible) return false;
+    // the direction is not renormalized, so t means the same thing in both spaces
+    Ray invRay = toObjectSpace(r);
+    const Object3D *target = accelerator != nullptr ? (const Object3D *) accelerator : object;
+    if (target->intersect(invRay, h, tmin)) {
+        Vec3f normal = h.getNormal();
+        if (affine) inverseTranspose.TransformDirectionAffine(normal);
+        else inverseTranspose.TransformDirection(normal);
+        normal.Normalize();
+        h.set(h.getT(), h.getMaterial(), normal, r, this);
+        return true;
     }
     return false;
 }
 
+bool Transform::intersectShadowRay(const Ray &r, Hit &h, float tmin) const {
+    // occlusion only, so the normal is never brought back to world space
+    if (!invertible) return false;
+    const Object3D *target = accelerator != nullptr ? (const Object3D *) accelerator : object;
+    return target->intersectShadowRay(toObjectSpace(r), h, tmin);
+}
+
 void Transform::paint() const {
     glPushMatrix();
     GLfloat *glMatrix = matrix.glGet();
@@ -333,194 +681,72 @@ void Transform::paint() const {
     glPopMatrix();
 }
 
-BoundingBox *Transform::getBoundingBox() {
-    Matrix m = matrix;
-    if (isTriangle) {
-        Triangle *t = (Triangle *) object;
-        Vec3f a = t->getA();
-        Vec3f b = t->getB();
-        Vec3f c = t->getC();
-        m.Transform(a);
-        m.Transform(b);
-        m.Transform(c);
-        boundingBox = new BoundingBox(Vec3f(min(a.x(), b.x()), min(a.y(), b.y()), min(a.z(), b.z())),
-                                      Vec3f(max(a.x(), b.x()), max(a.y(), b.y()), max(a.z(), b.z())));
-        boundingBox->Extend(c);
-    } else {
-        BoundingBox *bb = object->getBoundingBox();
-        Vec3f _v1 = bb->getMax();
-        Vec3f _v2 = bb->getMin();
-        float _x1 = _v1.x(), _y1 = _v1.y(), _z1 = _v1.z();
-        float _x2 = _v2.x(), _y2 = _v2.y(), _z2 = _v2.z();
-        Vec3f _v3(_x2, _y1, _z1);
-        Vec3f _v4(_x2, _y2, _z1);
-        Vec3f _v5(_x1, _y2, _z1);
-        Vec3f _v6(_x1, _y2, _z2);
-        Vec3f _v7(_x1, _y1, _z2);
-        Vec3f _v8(_x2, _y1, _z2);
-
-        m.Transform(_v1);
-        m.Transform(_v2);
-        m.Transform(_v3);
-        m.Transform(_v4);
-        m.Transform(_v5);
-        m.Transform(_v6);
-        m.Transform(_v7);
-        m.Transform(_v8);
-
-        _x1 = _v1.x(), _y1 = _v1.y(), _z1 = _v1.z();
-        _x2 = _v2.x(), _y2 = _v2.y(), _z2 = _v2.z();
-        float _x3 = _v3.x(), _y3 = _v3.y(), _z3 = _v3.z();
-        float _x4 = _v4.x(), _y4 = _v4.y(), _z4 = _v4.z();
-        float _x5 = _v5.x(), _y5 = _v5.y(), _z5 = _v5.z();
-        float _x6 = _v6.x(), _y6 = _v6.y(), _z6 = _v6.z();
-        float _x7 = _v7.x(), _y7 = _v7.y(), _z7 = _v7.z();
-        float _x8 = _v8.x(), _y8 = _v8.y(), _z8 = _v8.z();
-
-        float _xmin = _x1 < _x2 ? _x1 : _x2;
-        _xmin = _xmin < _x3 ? _xmin : _x3;
-        _xmin = _xmin < _x4 ? _xmin : _x4;
-        _xmin = _xmin < _x5 ? _xmin : _x5;
-        _xmin = _xmin < _x6 ? _xmin : _x6;
-        _xmin = _xmin < _x7 ? _xmin : _x7;
-        _xmin = _xmin < _x8 ? _xmin : _x8;
-
-        float _ymin = _y1 < _y2 ? _y1 : _y2;
-        _ymin = _ymin < _y3 ? _ymin : _y3;
-        _ymin = _ymin < _y4 ? _ymin : _y4;
-        _ymin = _ymin < _y5 ? _ymin : _y5;
-        _ymin = _ymin < _y6 ? _ymin : _y6;
-        _ymin = _ymin < _y7 ? _ymin : _y7;
-        _ymin = _ymin < _y8 ? _ymin : _y8;
-
-        float _zmin = _z1 < _z2 ? _z1 : _z2;
-        _zmin = _zmin < _z3 ? _zmin : _z3;
-        _zmin = _zmin < _z4 ? _zmin : _z4;
-        _zmin = _zmin < _z5 ? _zmin : _z5;
-        _zmin = _zmin < _z6 ? _zmin : _z6;
-        _zmin = _zmin < _z7 ? _zmin : _z7;
-        _zmin = _zmin < _z8 ? _zmin : _z8;
-
-        float _xmax = _x1 > _x2 ? _x1 : _x2;
-        _xmax = _xmax > _x3 ? _xmax : _x3;
-        _xmax = _xmax > _x4 ? _xmax : _x4;
-        _xmax = _xmax > _x5 ? _xmax : _x5;
-        _xmax = _xmax > _x6 ? _xmax : _x6;
-        _xmax = _xmax > _x7 ? _xmax : _x7;
-        _xmax = _xmax > _x8 ? _xmax : _x8;
-
-        float _ymax = _y1 > _y2 ? _y1 : _y2;
-        _ymax = _ymax > _y3 ? _ymax : _y3;
-        _ymax = _ymax > _y4 ? _ymax : _y4;
-        _ymax = _ymax > _y5 ? _ymax : _y5;
-        _ymax = _ymax > _y6 ? _ymax : _y6;
-        _ymax = _ymax > _y7 ? _ymax : _y7;
-        _ymax = _ymax > _y8 ? _ymax : _y8;
-
-        float _zmax = _z1 > _z2 ? _z1 : _z2;
-        _zmax = _zmax > _z3 ? _zmax : _z3;
-        _zmax = _zmax > _z4 ? _zmax : _z4;
-        _zmax = _zmax > _z5 ? _zmax : _z5;
-        _zmax = _zmax > _z6 ? _zmax : _z6;
-        _zmax = _zmax > _z7 ? _zmax : _z7;
-        _zmax = _zmax > _z8 ? _zmax : _z8;
-
-        boundingBox = new BoundingBox(Vec3f(_xmax, _ymax, _zmax), Vec3f(_xmin, _ymin, _zmin));
-    }
-    return boundingBox;
+BoundingBox *Transform::computeBoundingBox() {
+    BoundingBox *bb = object->getBoundingBox();
+    if (bb == nullptr) return nullptr;
+    // the world space box is the box around the 8 transformed corners
+    Vec3f corners[2] = {bb->getMin(), bb->getMax()};
+    BoundingBox *answer = nullptr;
+    for (int c = 0; c < 8; c++) {
+        Vec3f v(corners[c & 1].x(), corners[(c >> 1) & 1].y(), corners[(c >> 2) & 1].z());
+        matrix.Transform(v);
+        if (answer == nullptr) answer = new BoundingBox(v, v);
+        else answer->Extend(v);
+    }
+    return answer;
 }
 
 void Transform::insertIntoGrid(Grid *g, Matrix *m) {
-    Vec3f m_min = boundingBox->getMin();
-    Vec3f m_max = boundingBox->getMax();
-    Vec3f v = g->getGrid();
-    BoundingBox *bb = g->getBoundingBox();
-    Vec3f min = bb->getMin();
-    Vec3f max = Vec3f(bb->getMax().x(), bb->getMax().y(), bb->getMax().z());
-    int x = v.x();
-    int y = v.y();
-    int z = v.z();
-    Vec3f size = max - min;
-    float grid_x = size.x() / x;
-    float grid_y = size.y() / y;
-    float grid_z = size.z() / z;
-
-    int _start_i = (fabs(m_min.x() - min.x())) * (1 / grid_x);
-    int _start_j = (fabs(m_min.y() - min.y())) * (1 / grid_y);
-    int _start_k = (fabs(m_min.z() - min.z())) * (1 / grid_z);
-    int _end_i = (fabs(m_max.x() - min.x())) * (1 / grid_x);
-    int _end_j = (fabs(m_max.y() - min.y())) * (1 / grid_y);
-    int _end_k = (fabs(m_max.z() - min.z())) * (1 / grid_z);
-
-    if (_start_i == _end_i) _start_i--;
-    if (_start_j == _end_j) _start_j--;
-    if (_start_k == _end_k) _start_k--;
-    if (_start_i > _end_i) swap(_start_i, _end_i);
-    if (_start_j > _end_j) swap(_start_j, _end_j);
-    if (_start_k > _end_k) swap(_start_k, _end_k);
-
-    //assert(_end_i <= x && _end_j <= y && _end_k <= z);
-    if (_end_i > x)_end_i--;
-    if (_end_j > y)_end_j--;
-    if (_end_k > z)_end_k--;
-
-    for (int _i = _start_i; _i < _end_i; _i++) {
-        for (int _j = _start_j; _j < _end_j; _j++) {
-            for (int _k = _start_k; _k < _end_k; _k++) {
-                g->insertIntoThis((_i * y + _j) * z + _k, this);
-            }
-        }
-    }
+    g->getInstances()->attach(this, object);
+    if (boundingBox == nullptr) g->insertUnbounded(this);
+    else g->insertBoundingBox(boundingBox, this);
+}
+
+void Transform::insertFaceIntoGrid(int, Grid *g) {
+    // already attached by the grid it was first inserted into
+    g->insertBoundingBox(boundingBox, this);
+}
+
+void Transform::insertIntoBVH(BVH *bvh) {
+    bvh->getInstances()->attach(this, object);
+    bvh->insertIntoThis(this);
 }
 
 /*
  * GRID
  */
 
-PhongMaterial *getColor(int size) {
-    PhongMaterial *col;
-    switch (size) {
-        case 1:
-            col = new PhongMaterial(Vec3f(1, 1, 1));
-            break;
-        case 2:
-            col = new PhongMaterial(Vec3f(1, 0, 1));
-            break;
-        case 3:
-            col = new PhongMaterial(Vec3f(0, 1, 1));
-            break;
-        case 4:
-            col = new PhongMaterial(Vec3f(1, 1, 0));
-            break;
-        case 5:
-            col = new PhongMaterial(Vec3f(0.3, 0, 0.7));
-            break;
-        case 6:
-            col = new PhongMaterial(Vec3f(0.7, 0, 0.3));
-            break;
-        case 7:
-            col = new PhongMaterial(Vec3f(0, 0.3, 0.7));
-            break;
-        case 8:
-            col = new PhongMaterial(Vec3f(0, 0.7, 0.3));
-            break;
-        case 9:
-            col = new PhongMaterial(Vec3f(0, 0.3, 0.7));
-            break;
-        case 10:
-            col = new PhongMaterial(Vec3f(0, 0.7, 0.3));
-            break;
-        case 11:
-            col = new PhongMaterial(Vec3f(0, 1, 0));
-            break;
-        case 12:
-            col = new PhongMaterial(Vec3f(0, 0, 1));
-            break;
-        default:
-            col = new PhongMaterial(Vec3f(1, 0, 0));
-            break;
-    }
-    return col;
+// the palette is shared, the materials are handed out to Hits
+static PhongMaterial *getColor(int size) {
+    static PhongMaterial palette[13] = {
+            PhongMaterial(Vec3f(1, 0, 0)),
+            PhongMaterial(Vec3f(1, 1, 1)),
+            PhongMaterial(Vec3f(1, 0, 1)),
+            PhongMaterial(Vec3f(0, 1, 1)),
+            PhongMaterial(Vec3f(1, 1, 0)),
+            PhongMaterial(Vec3f(0.3, 0, 0.7)),
+            PhongMaterial(Vec3f(0.7, 0, 0.3)),
+            PhongMaterial(Vec3f(0, 0.3, 0.7)),
+            PhongMaterial(Vec3f(0, 0.7, 0.3)),
+            PhongMaterial(Vec3f(0, 0.3, 0.7)),
+            PhongMaterial(Vec3f(0, 0.7, 0.3)),
+            PhongMaterial(Vec3f(0, 1, 0)),
+            PhongMaterial(Vec3f(0, 0, 1))
+    };
+    if (size < 1 || size > 12) return &palette[0];
+    return &palette[size];
+}
+
+BVHInstances *Grid::getInstances() {
+    if (instances == nullptr) instances = new BVHInstances();
+    return instances;
+}
+
+Grid::~Grid() {
+    for (Grid *sub: subgrids) delete sub;
+    // a subgrid's box is the cell it was made for
+    if (parent) delete boundingBox;
+    delete instances;
 }
 
 void Grid::paint() const {
@@ -549,14 +775,14 @@ void Grid::paint() const {
                 int index_x = (i + 1) * ny * nz + j * nz + k;
                 int index_y = i * ny * nz + (j + 1) * nz + k;
                 int index_z = i * ny * nz + j * nz + (k + 1);
-                bool isOpaque = !opaque[index].empty();
-                bool isOpaque_x = (i == nx - 1) ? false : !opaque[index_x].empty();
-                bool isOpaque_y = (j == ny - 1) ? false : !opaque[index_y].empty();
-                bool isOpaque_z = (k == nz - 1) ? false : !opaque[index_z].empty();
-                col = getColor(opaque[index].size());
-                col_x = getColor(opaque[index_x].size());
-                col_y = getColor(opaque[index_y].size());
-                col_z = getColor(opaque[index_z].size());
+                bool isOpaque = getCellSize(index) > 0;
+                bool isOpaque_x = (i == nx - 1) ? false : getCellSize(index_x) > 0;
+                bool isOpaque_y = (j == ny - 1) ? false : getCellSize(index_y) > 0;
+                bool isOpaque_z = (k == nz - 1) ? false : getCellSize(index_z) > 0;
+                col = getColor(getCellSize(index));
+                col_x = isOpaque_x ? getColor(getCellSize(index_x)) : col;
+                col_y = isOpaque_y ? getColor(getCellSize(index_y)) : col;
+                col_z = isOpaque_z ? getColor(getCellSize(index_z)) : col;
                 col->glSetMaterial();
                 if (i == 0 && isOpaque) {
                     glBegin(GL_QUADS);
@@ -618,161 +844,380 @@ void Grid::paint() const {
                     glVertex3f(o_.x(), o_.y(), o_.z());
                     glEnd();
                 }
-                delete col;
-                delete col_x;
-                delete col_y;
-                delete col_z;
             }
         }
     }
 }
 
-void Grid::initializeRayMarch(MarchingInfo &mi, const Ray &r, float tmin) const {
-    Vec3f ro = r.getOrigin();
-    Vec3f rd = r.getDirection();
-    rd.Normalize();
-    Vec3f min_Box = boundingBox->getMin();
-    Vec3f max_Box = boundingBox->getMax();
-    float cell_x = (max_Box - min_Box).x() / nx;
-    float cell_y = (max_Box - min_Box).y() / ny;
-    float cell_z = (max_Box - min_Box).z() / nz;
-
-    //x_slab
-    float t_x_near;
-    float t_x_fal;
-    if (fabs(rd.Dot3(Vec3f(1.0, 0.0, 0.0))) < epsilon) {
-        t_x_near = (min_Box - ro).x() > 0 ? INFINITY : -INFINITY;
-        t_x_fal = (max_Box - ro).x() > 0 ? INFINITY : -INFINITY;
-    } else {
-        t_x_near = (min_Box - ro).x() / rd.x();
-        t_x_fal = (max_Box - ro).x() / rd.x();
-        if (t_x_near > t_x_fal) {
-            float temp = t_x_near;
-            t_x_near = t_x_fal;
-            t_x_fal = temp;
-        }
+int Grid::getPrimitiveId(Object3D *obj, int face) {
+    if (parent) return parent->getPrimitiveId(obj, face);
+    // objects insert themselves cell by cell, usually one right after
+    // another; the last primitive is then the last face of obj
+    if (!primitives.empty() && primitives.back().object == obj) {
+        return primitives.size() - 1 - primitives.back().face + face;
+    }
+    auto found = primitiveIds.find(obj);
+    if (found != primitiveIds.end()) return found->second + face;
+    int id = primitives.size();
+    int n = obj->getNumFaces();
+    for (int f = 0; f < n; f++) {
+        primitives.push_back(Primitive{obj, f});
     }
+    primitiveIds[obj] = id;
+    return id + face;
+}
 
-    //y_slab
-    float t_y_near;
-    float t_y_fal;
-    if (fabs(rd.Dot3(Vec3f(0.0, 1.0, 0.0))) < epsilon) {
-        t_y_near = (min_Box - ro).y() > 0 ? INFINITY : -INFINITY;
-        t_y_fal = (max_Box - ro).y() > 0 ? INFINITY : -INFINITY;
-    } else {
-        t_y_near = (min_Box - ro).y() / rd.y();
-        t_y_fal = (max_Box - ro).y() / rd.y();
-        if (t_y_near > t_y_fal) {
-            float temp = t_y_near;
-            t_y_near = t_y_fal;
-            t_y_fal = temp;
+void Grid::getCellRange(const Vec3f &min, const Vec3f &max, int start[3], int end[3]) const {
+    Vec3f grid_min = boundingBox->getMin();
+    Vec3f grid_size = boundingBox->getMax() - grid_min;
+    int n[3] = {nx, ny, nz};
+    for (int a = 0; a < 3; a++) {
+        float cell = grid_size[a] / n[a];
+        if (cell <= 0) {
+            // the grid is flat along this axis
+            start[a] = 0;
+            end[a] = 0;
+            continue;
         }
+        start[a] = int(floor((min[a] - grid_min[a]) / cell));
+        end[a] = int(floor((max[a] - grid_min[a]) / cell));
+        start[a] = std::max(0, std::min(start[a], n[a] - 1));
+        end[a] = std::max(0, std::min(end[a], n[a] - 1));
     }
+}
 
-    //z_slab
-    float t_z_near;
-    float t_z_fal;
-    if (fabs(rd.Dot3(Vec3f(0.0, 0.0, 1.0))) < epsilon) {
-        t_z_near = (min_Box - ro).z() > 0 ? INFINITY : -INFINITY;
-        t_z_fal = (max_Box - ro).z() > 0 ? INFINITY : -INFINITY;
-    } else {
-        t_z_near = (min_Box - ro).z() / rd.z();
-        t_z_fal = (max_Box - ro).z() / rd.z();
-        if (t_z_near > t_z_fal) {
-            float temp = t_z_near;
-            t_z_near = t_z_fal;
-            t_z_fal = temp;
+void Grid::getCellBounds(int i, int j, int k, Vec3f &min, Vec3f &max) const {
+    Vec3f grid_min = boundingBox->getMin();
+    Vec3f grid_size = boundingBox->getMax() - grid_min;
+    int cell[3] = {i, j, k};
+    int n[3] = {nx, ny, nz};
+    float lo[3], hi[3];
+    for (int a = 0; a < 3; a++) {
+        lo[a] = grid_min[a] + grid_size[a] * cell[a] / n[a];
+        hi[a] = grid_min[a] + grid_size[a] * (cell[a] + 1) / n[a];
+    }
+    min = Vec3f(lo[0], lo[1], lo[2]);
+    max = Vec3f(hi[0], hi[1], hi[2]);
+}
+
+// separating axis test (Akenine-Moller) of the triangle a, b, c and the
+// box center +- half: the box axes, the normal of the triangle and the
+// cross products of its edges with the box axes
+static bool triangleOverlapsBox(const Vec3f &center, const Vec3f &half,
+                                const Vec3f &a, const Vec3f &b, const Vec3f &c) {
+    Vec3f v[3] = {a - center, b - center, c - center};
+    for (int k = 0; k < 3; k++) {
+        if (min(min(v[0][k], v[1][k]), v[2][k]) > half[k]) return false;
+        if (max(max(v[0][k], v[1][k]), v[2][k]) < -half[k]) return false;
+    }
+    Vec3f e[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+    for (int i = 0; i < 3; i++) {
+        // x, y and z cross e
+        Vec3f axes[3] = {Vec3f(0, -e[i].z(), e[i].y()), Vec3f(e[i].z(), 0, -e[i].x()),
+                         Vec3f(-e[i].y(), e[i].x(), 0)};
+        for (const Vec3f &axis: axes) {
+            float p0 = v[0].Dot3(axis);
+            float p1 = v[1].Dot3(axis);
+            float p2 = v[2].Dot3(axis);
+            float r = half.x() * fabs(axis.x()) + half.y() * fabs(axis.y()) + half.z() * fabs(axis.z());
+            if (min(min(p0, p1), p2) > r || max(max(p0, p1), p2) < -r) return false;
         }
     }
+    Vec3f normal;
+    Vec3f::Cross3(normal, e[0], e[1]);
+    float r = half.x() * fabs(normal.x()) + half.y() * fabs(normal.y()) + half.z() * fabs(normal.z());
+    return fabs(normal.Dot3(v[0])) <= r;
+}
 
-    float t_near = max(max(t_x_near, t_y_near), t_z_near);
-    float t_far = min(min(t_x_fal, t_y_fal), t_z_fal);
+// the cells are tested a little larger than they are, so rounding never
+// drops a cell that a surface just touches
+Vec3f Grid::getCellSlack() const {
+    Vec3f size = boundingBox->getMax() - boundingBox->getMin();
+    float slack = 1e-5f * max(max(size.x(), size.y()), size.z());
+    return Vec3f(slack, slack, slack);
+}
 
-    if (t_far < tmin || t_near > t_far) {
-        //no intersection
-        //FIXME:mi constructor √
-        return;
-    } else {
-        //intersection
-        mi.sign_x = (rd.x() > 0) ? 1 : -1;
-        mi.sign_y = (rd.y() > 0) ? 1 : -1;
-        mi.sign_z = (rd.z() > 0) ? 1 : -1;
-
-        mi.dt_x = fabs(cell_x / rd.x());
-        mi.dt_y = fabs(cell_y / rd.y());
-        mi.dt_z = fabs(cell_z / rd.z());
-
-        if (t_near < tmin) {
-            //inside
-            if (t_x_near > -INFINITY) {
-                while (t_x_near <= t_near)t_x_near += mi.dt_x;
-                mi.t_next_x = t_x_near;
-            }
-            if (t_y_near > -INFINITY) {
-                while (t_y_near <= t_near)t_y_near += mi.dt_y;
-                mi.t_next_y = t_y_near;
-            }
-            if (t_z_near > -INFINITY) {
-                while (t_z_near <= t_near)t_z_near += mi.dt_z;
-                mi.t_next_z = t_z_near;
+void Grid::insertTriangle(const Vec3f &a, const Vec3f &b, const Vec3f &c, Object3D *obj, int face) {
+    Vec3f lo(min(min(a.x(), b.x()), c.x()), min(min(a.y(), b.y()), c.y()), min(min(a.z(), b.z()), c.z()));
+    Vec3f hi(max(max(a.x(), b.x()), c.x()), max(max(a.y(), b.y()), c.y()), max(max(a.z(), b.z()), c.z()));
+    int start[3], end[3];
+    getCellRange(lo, hi, start, end);
+    Vec3f slack = getCellSlack();
+    for (int i = start[0]; i <= end[0]; i++) {
+        for (int j = start[1]; j <= end[1]; j++) {
+            for (int k = start[2]; k <= end[2]; k++) {
+                Vec3f cell_min, cell_max;
+                getCellBounds(i, j, k, cell_min, cell_max);
+                Vec3f half = 0.5f * (cell_max - cell_min) + slack;
+                if (triangleOverlapsBox(0.5f * (cell_min + cell_max), half, a, b, c)) {
+                    insertIntoThis(getIndex(i, j, k), obj, face);
+                } else {
+                    rejected_entries++;
+                }
             }
+        }
+    }
+}
 
-            t_x_near = t_x_near > tmin ? t_x_near : INFINITY;
-            t_y_near = t_y_near > tmin ? t_y_near : INFINITY;
-            t_z_near = t_z_near > tmin ? t_z_near : INFINITY;
+void Grid::insertSphere(const Vec3f &center, float radius, Object3D *obj) {
+    // the cells of the bounding box whose closest point to the center is
+    // inside the sphere
+    Vec3f extent(radius, radius, radius);
+    int start[3], end[3];
+    getCellRange(center - extent, center + extent, start, end);
+    Vec3f slack = getCellSlack();
+    for (int i = start[0]; i <= end[0]; i++) {
+        for (int j = start[1]; j <= end[1]; j++) {
+            for (int k = start[2]; k <= end[2]; k++) {
+                Vec3f cell_min, cell_max;
+                getCellBounds(i, j, k, cell_min, cell_max);
+                cell_min -= slack;
+                cell_max += slack;
+                float d2 = 0;
+                for (int a = 0; a < 3; a++) {
+                    float d = max(cell_min[a] - center[a], 0.0f) + max(center[a] - cell_max[a], 0.0f);
+                    d2 += d * d;
+                }
+                if (d2 <= radius * radius) {
+                    insertIntoThis(getIndex(i, j, k), obj);
+                } else {
+                    rejected_entries++;
+                }
+            }
+        }
+    }
+}
 
-            t_near = min(min(t_x_near, t_y_near), t_z_near);
-            mi.tmin = t_near;
+void Grid::build() {
+    // counting sort by cell: the sizes, their running sums (where each
+    // cell ends), then the ids from the back, which leaves every offset
+    // at the start of its cell and the ids in insertion order
+    int cells = nx * ny * nz;
+    assert(pending.size() <= UINT32_MAX);
+    cell_offsets.assign(cells + 1, 0);
+    for (const Entry &entry: pending) {
+        cell_offsets[entry.cell]++;
+    }
+    for (int c = 1; c <= cells; c++) {
+        cell_offsets[c] += cell_offsets[c - 1];
+    }
+    cell_entries.resize(pending.size());
+    for (size_t e = pending.size(); e-- > 0;) {
+        cell_entries[--cell_offsets[pending[e].cell]] = pending[e].id;
+    }
+    pending.clear();
+    pending.shrink_to_fit();
+    if (parent == nullptr && GRID_SUBDIVIDE > 0) subdivide();
+}
 
-            if (t_near == t_x_near) {
-                mi.normal = Vec3f(-1.0, 0.0, 0.0) * mi.sign_x;
-                mi.t_next_x = t_x_near + mi.dt_x;
-                mi.t_next_y = t_y_near;
-                mi.t_next_z = t_z_near;
-            }
-            if (t_near == t_y_near) {
-                mi.normal = Vec3f(0.0, -1.0, 0.0) * mi.sign_y;
-                mi.t_next_x = t_x_near;
-                mi.t_next_y = t_y_near + mi.dt_y;
-                mi.t_next_z = t_z_near;
-            }
-            if (t_near == t_z_near) {
-                mi.normal = Vec3f(0.0, 0.0, -1.0) * mi.sign_z;
-                mi.t_next_x = t_x_near;
-                mi.t_next_y = t_y_near;
-                mi.t_next_z = t_z_near + mi.dt_z;
+void Grid::subdivide() {
+    // a crowded cell (a detailed object in a big, mostly empty scene)
+    // gets a grid over just that cell; its entries are replaced by one
+    // that points to the grid, compacting cell_entries as we go
+    vector<char> skip(primitives.size(), 0);
+    for (int id: unbounded) skip[id] = 1;
+    vector<int> ids;
+    uint32_t kept = 0;
+    uint32_t begin = 0;
+    for (int c = 0; c < nx * ny * nz; c++) {
+        uint32_t end = cell_offsets[c + 1];
+        cell_offsets[c] = kept;
+        ids.clear();
+        for (uint32_t e = begin; e < end; e++) {
+            // planes and the like are tested by every ray anyway
+            if (!skip[cell_entries[e]]) ids.push_back(cell_entries[e]);
+        }
+        Grid *sub = nullptr;
+        if (ids.size() > GRID_SUBDIVIDE) {
+            // over what the primitives cover of the cell, which may be
+            // only a corner of it
+            Vec3f min, max;
+            getCellBounds(c / (ny * nz), c / nz % ny, c % nz, min, max);
+            Vec3f slack = getCellSlack();
+            BoundingBox bounds = primitives[ids[0]].object->getFaceBoundingBox(primitives[ids[0]].face);
+            for (int id: ids) {
+                BoundingBox face_bb = primitives[id].object->getFaceBoundingBox(primitives[id].face);
+                bounds.Extend(&face_bb);
             }
-        } else {
-            //outside
-            mi.tmin = t_near;
-            if (t_near == t_x_near)mi.normal = Vec3f(-1.0, 0.0, 0.0) * mi.sign_x;
-            if (t_near == t_y_near)mi.normal = Vec3f(0.0, -1.0, 0.0) * mi.sign_y;
-            if (t_near == t_z_near)mi.normal = Vec3f(0.0, 0.0, -1.0) * mi.sign_z;
-
-            if (t_x_near > -INFINITY) {
-                while (t_x_near <= t_near)t_x_near += mi.dt_x;
-                mi.t_next_x = t_x_near;
+            Vec3f lo, hi;
+            Vec3f::Max(lo, bounds.getMin(), min - slack);
+            Vec3f::Min(hi, bounds.getMax(), max + slack);
+            BoundingBox *bb = new BoundingBox(lo, hi);
+            int n[3];
+            chooseResolution(bb, ids.size(), n[0], n[1], n[2]);
+            if (n[0] * n[1] * n[2] > 1) {
+                sub = new Grid(bb, n[0], n[1], n[2]);
+                sub->parent = this;
+                sub->cell_primitives = ids.size();
+                for (int id: ids) {
+                    primitives[id].object->insertFaceIntoGrid(primitives[id].face, sub);
+                }
+                sub->build();
+                cell_entries[kept++] = -1 - int(subgrids.size());
+                subgrids.push_back(sub);
+            } else delete bb;
+        }
+        if (sub == nullptr) {
+            for (uint32_t e = begin; e < end; e++) {
+                cell_entries[kept++] = cell_entries[e];
             }
-            if (t_y_near > -INFINITY) {
-                while (t_y_near <= t_near)t_y_near += mi.dt_y;
-                mi.t_next_y = t_y_near;
+        }
+        begin = end;
+    }
+    cell_offsets[nx * ny * nz] = kept;
+    cell_entries.resize(kept);
+    cell_entries.shrink_to_fit();
+}
+
+long long Grid::getNumOccupiedCells() const {
+    long long occupied = 0;
+    for (int c = 0; c < nx * ny * nz; c++) {
+        if (getCellSize(c) > 0) occupied++;
+    }
+    return occupied;
+}
+
+void Grid::chooseResolution(BoundingBox *bb, int num_primitives, int &nx, int &ny, int &nz) {
+    Vec3f size = bb->getMax() - bb->getMin();
+    float longest = max(max(size.x(), size.y()), size.z());
+    // the cell edge that gives the density over the axes that aren't
+    // flat; flat ones (a scene in a plane) are one cell thick
+    float volume = 1;
+    int dimensions = 0;
+    for (int a = 0; a < 3; a++) {
+        if (size[a] > longest * 1e-3f) {
+            volume *= size[a];
+            dimensions++;
+        }
+    }
+    int n[3] = {1, 1, 1};
+    if (dimensions > 0 && num_primitives > 0) {
+        float cell = pow(volume / (GRID_AUTO_DENSITY * num_primitives), 1.0f / dimensions);
+        for (int a = 0; a < 3; a++) {
+            if (size[a] > longest * 1e-3f) {
+                n[a] = max(1, min(GRID_AUTO_MAX, int(lround(size[a] / cell))));
             }
-            if (t_z_near > -INFINITY) {
-                while (t_z_near <= t_near)t_z_near += mi.dt_z;
-                mi.t_next_z = t_z_near;
+        }
+    }
+    nx = n[0];
+    ny = n[1];
+    nz = n[2];
+}
+
+void Grid::printStats(FILE *out) const {
+    long long cells = (long long) nx * ny * nz;
+    long long entries = getNumEntries();
+    long long occupied = getNumOccupiedCells();
+    fprintf(out, "grid cells          %12lld  %dx%dx%d\n", cells, nx, ny, nz);
+    fprintf(out, "  occupied          %12lld  %7.2f%%\n", occupied, cells > 0 ? 100.0 * occupied / cells : 0.0);
+    fprintf(out, "grid entries        %12lld  %8.2f per occupied cell\n", entries,
+            occupied > 0 ? double(entries) / occupied : 0.0);
+    fprintf(out, "  by bounding box   %12lld  %8.2f per occupied cell\n", entries + rejected_entries,
+            occupied > 0 ? double(entries + rejected_entries) / occupied : 0.0);
+    if (subgrids.empty()) return;
+    long long sub_cells = 0, sub_entries = 0, sub_occupied = 0, sub_primitives = 0;
+    for (Grid *sub: subgrids) {
+        sub_cells += (long long) sub->nx * sub->ny * sub->nz;
+        sub_entries += sub->getNumEntries();
+        sub_occupied += sub->getNumOccupiedCells();
+        sub_primitives += sub->cell_primitives;
+    }
+    fprintf(out, "subgrids            %12zu  %8.2f primitives each\n", subgrids.size(),
+            double(sub_primitives) / subgrids.size());
+    fprintf(out, "  cells             %12lld\n", sub_cells);
+    fprintf(out, "  entries           %12lld  %8.2f per occupied cell\n", sub_entries,
+            sub_occupied > 0 ? double(sub_entries) / sub_occupied : 0.0);
+}
+
+void Grid::insertBoundingBox(BoundingBox *bb, Object3D *obj, int face) {
+    int start[3], end[3];
+    getCellRange(bb->getMin(), bb->getMax(), start, end);
+    for (int i = start[0]; i <= end[0]; i++) {
+        for (int j = start[1]; j <= end[1]; j++) {
+            for (int k = start[2]; k <= end[2]; k++) {
+                insertIntoThis(getIndex(i, j, k), obj, face);
             }
         }
-        Vec3f p = ro + rd * t_near - min_Box;
-        mi.i = int(p.x() / cell_x);
-        if (mi.sign_x < 0 && mi.i == nx)mi.i--;
-        mi.j = int(p.y() / cell_y);
-        if (mi.sign_y < 0 && mi.j == ny)mi.j++;
-        mi.k = int(p.z() / cell_z);
-        if (mi.sign_z < 0 && mi.k == nz)mi.k++;
     }
 }
 
-bool Grid::intersect(const Ray &r, Hit &h, float tmin) {
+void Grid::initializeRayMarch(MarchingInfo &mi, const Ray &r, float tmin) const {
+    // t is measured along the ray's own (unnormalized) direction, so the
+    // values are comparable with the t of the hits
+    Vec3f ro = r.getOrigin();
+    Vec3f rd = r.getDirection();
+    Vec3f min_Box = boundingBox->getMin();
+    Vec3f max_Box = boundingBox->getMax();
+    int n[3] = {nx, ny, nz};
+
+    // slab test against the grid bounding box
+    float t_near = -INFINITY;
+    float t_far = INFINITY;
+    int enter_axis = 0;
+    for (int a = 0; a < 3; a++) {
+        if (rd[a] == 0) {
+            if (ro[a] < min_Box[a] || ro[a] > max_Box[a]) return;
+            continue;
+        }
+        float t0 = (min_Box[a] - ro[a]) / rd[a];
+        float t1 = (max_Box[a] - ro[a]) / rd[a];
+        if (t0 > t1) swap(t0, t1);
+        if (t0 > t_near) {
+            t_near = t0;
+            enter_axis = a;
+        }
+        if (t1 < t_far) t_far = t1;
+    }
+    if (t_far < tmin || t_near > t_far) {
+        //no intersection, mi.tmin stays INFINITY
+        return;
+    }
+
+    float t_start = t_near;
+    Vec3f normal(0.0, 0.0, 0.0);
+    if (t_near < tmin) {
+        //inside: start at tmin, in the cell that contains that point
+        t_start = tmin;
+    } else {
+        //outside: enter through the face of the last slab crossed
+        float sign = rd[enter_axis] > 0 ? -1 : 1;
+        normal = Vec3f(enter_axis == 0 ? sign : 0, enter_axis == 1 ? sign : 0, enter_axis == 2 ? sign : 0);
+    }
+    mi.tmin = t_start;
+    mi.normal = normal;
+
+    Vec3f p = ro + rd * t_start - min_Box;
+    int index[3];
+    float sign[3], dt[3], t_next[3];
+    for (int a = 0; a < 3; a++) {
+        float cell = (max_Box[a] - min_Box[a]) / n[a];
+        index[a] = cell > 0 ? int(floor(p[a] / cell)) : 0;
+        index[a] = max(0, min(index[a], n[a] - 1));
+        sign[a] = rd[a] > 0 ? 1 : -1;
+        if (rd[a] == 0 || cell <= 0) {
+            dt[a] = INFINITY;
+            t_next[a] = INFINITY;
+        } else {
+            dt[a] = fabs(cell / rd[a]);
+            float boundary = min_Box[a] + (index[a] + (rd[a] > 0 ? 1 : 0)) * cell;
+            t_next[a] = (boundary - ro[a]) / rd[a];
+        }
+    }
+    mi.i = index[0];
+    mi.j = index[1];
+    mi.k = index[2];
+    mi.sign_x = sign[0];
+    mi.sign_y = sign[1];
+    mi.sign_z = sign[2];
+    mi.dt_x = dt[0];
+    mi.dt_y = dt[1];
+    mi.dt_z = dt[2];
+    mi.t_next_x = t_next[0];
+    mi.t_next_y = t_next[1];
+    mi.t_next_z = t_next[2];
+}
+
+bool Grid::intersectVisualize(const Ray &r, Hit &h, float tmin) const {
     MarchingInfo mi;
     initializeRayMarch(mi, r, tmin);
 
@@ -783,8 +1228,9 @@ bool Grid::intersect(const Ray &r, Hit &h, float tmin) {
             int j = mi.j;
             int k = mi.k;
             int index = i * ny * nz + j * nz + k;
-            if (!opaque[index].empty()) {
-                PhongMaterial *m = getColor(opaque[index].size());
+            if (getCellSize(index) > 0) {
+                Grid *sub = getSubgrid(index);
+                PhongMaterial *m = getColor(sub ? sub->cell_primitives : getCellSize(index));
                 h.set(mi.tmin, m, mi.normal, r);
                 return true;
             }
@@ -794,8 +1240,68 @@ bool Grid::intersect(const Ray &r, Hit &h, float tmin) {
     return false;
 }
 
-/*
- * TODO:INFINITY?
- * TODO:t_next
- * TODO:normal,ijk
- */
\ No newline at end of file
+template<bool anyHit>
+bool Grid::march(const Ray &r, Hit &h, float tmin, Mailbox &mailbox, const vector<Primitive> &prims) const {
+    MarchingInfo mi;
+    initializeRayMarch(mi, r, tmin);
+    bool flag = false;
+    while (mi.tmin < h.getT() &&
+           mi.i >= 0 && mi.j >= 0 && mi.k >= 0 &&
+           mi.i < nx && mi.j < ny && mi.k < nz) {
+        RAYSTAT(grid_cells);
+        int index = int(mi.i) * ny * nz + int(mi.j) * nz + int(mi.k);
+        Grid *sub = getSubgrid(index);
+        if (sub) {
+            if (sub->march<anyHit>(r, h, tmin, mailbox, prims)) {
+                if (anyHit) return true;
+                flag = true;
+            }
+        } else {
+            for (uint32_t e = cell_offsets[index]; e < cell_offsets[index + 1]; e++) {
+                int id = cell_entries[e];
+                if (mailbox.testAndSet(id)) continue;
+                const Primitive &p = prims[id];
+                if (anyHit) {
+                    if (p.object->intersectFaceShadowRay(p.face, r, h, tmin)) return true;
+                } else if (p.object->intersectFace(p.face, r, h, tmin)) flag = true;
+            }
+        }
+        // a hit found here may lie in a later cell (the object spans
+        // several cells); it only stops the march once the ray reaches it,
+        // a nearer object may still be waiting in the cells in between
+        float t_exit = min(min(mi.t_next_x, mi.t_next_y), mi.t_next_z);
+        if (h.getT() <= t_exit) break;
+        mi.nextCell();
+    }
+    return flag;
+}
+
+bool Grid::intersectShadowRay(const Ray &r, Hit &h, float tmin) const {
+    if (visualize) return intersectVisualize(r, h, tmin);
+
+    // any hit closer than h.getT() (the light) will do, so no sorting
+    // by t and no normals: return at the first blocker
+    Mailbox mailbox;
+    for (int id: unbounded) {
+        mailbox.testAndSet(id);
+        const Primitive &p = primitives[id];
+        if (p.object->intersectFaceShadowRay(p.face, r, h, tmin)) return true;
+    }
+    RAYSTAT(grid_rays);
+    return march<true>(r, h, tmin, mailbox, primitives);
+}
+
+bool Grid::intersect(const Ray &r, Hit &h, float tmin) const {
+    if (visualize) return intersectVisualize(r, h, tmin);
+
+    Mailbox mailbox;
+    bool flag = false;
+    for (int id: unbounded) {
+        mailbox.testAndSet(id);
+        const Primitive &p = primitives[id];
+        if (p.object->intersectFace(p.face, r, h, tmin)) flag = true;
+    }
+    RAYSTAT(grid_rays);
+    if (march<false>(r, h, tmin, mailbox, primitives)) flag = true;
+    return flag;
+}
@@ -3,26 +3,78 @@
 
 #include "ray.h"
 #include "hit.h"
+#include "rayPacket.h"
+#include "rayStats.h"
 #include "material.h"
 #include "LAlib/matrix.h"
 #include "boundingbox.h"
 #include "marchinginfo.h"
 #include <vector>
+#include <unordered_map>
+
+// ====================================================================
+// triangle intersection kernel, override with -DTRIANGLE_MOLLER_TRUMBORE=0
+
+//   0: Cramer's rule, four 3x3 determinants and divisions per test
+//   1: Moller-Trumbore, rejects on beta and gamma before computing t
+#ifndef TRIANGLE_MOLLER_TRUMBORE
+#define TRIANGLE_MOLLER_TRUMBORE 1
+#endif
+
+// ====================================================================
 
 class Grid;
 
+class BVH;
+
+class BVHInstances;
+
 class Object3D {
 public:
     Object3D() {};
 
-    virtual bool intersect(const Ray &r, Hit &h, float tmin) = 0;
+    virtual bool intersect(const Ray &r, Hit &h, float tmin) const = 0;
+
+    // occlusion query: true if anything lies in (tmin, h.getT()).
+    // implementations may stop at any blocker and don't have to update h
+    virtual bool intersectShadowRay(const Ray &r, Hit &h, float tmin) const = 0;
+
+    // closest hits of a whole packet; the default traces the lanes one
+    // by one with intersect(), primitives override it with SIMD kernels
+    virtual void intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const;
+
+    // meshes are made of faces that the grid and the BVH store one by
+    // one; any other object is a single face, face 0
+    virtual int getNumFaces() const { return 1; }
 
-    virtual bool intersectShadowRay(const Ray &r, Hit &h, float tmin) = 0;
+    // what an accelerator stores for this object, a group adds up its objects
+    virtual int getNumPrimitives() const { return getNumFaces(); }
+
+    virtual bool intersectFace(int, const Ray &r, Hit &h, float tmin) const {
+        return intersect(r, h, tmin);
+    }
+
+    virtual bool intersectFaceShadowRay(int, const Ray &r, Hit &h, float tmin) const {
+        return intersectShadowRay(r, h, tmin);
+    }
+
+    virtual void intersectFacePacket(int, const RayPacket &r, HitPacket &h, float tmin) const {
+        intersectPacket(r, h, tmin);
+    }
 
     virtual void paint() const = 0;
 
     virtual void insertIntoGrid(Grid *g, Matrix *m) {};
 
+    // a single face again, into the grid of a crowded cell
+    virtual void insertFaceIntoGrid(int, Grid *g) { insertIntoGrid(g, nullptr); }
+
+    // bounded objects only
+    virtual BoundingBox getFaceBoundingBox(int) { return *getBoundingBox(); }
+
+    // by default an object is a single BVH primitive
+    virtual void insertIntoBVH(BVH *bvh);
+
     virtual BoundingBox *getBoundingBox() = 0;
 
     virtual ~Object3D() {};
@@ -33,6 +85,12 @@ protected:
     bool isTriangle = false;
 };
 
+// what the accelerators store: an object and one of its faces
+struct Primitive {
+    Object3D *object;
+    int face;
+};
+
 class Group : public Object3D {
 public:
     Group(int n) : num_objects(n) {
@@ -42,15 +100,30 @@ public:
         objects = new Object3D *[num_objects];
     }
 
-    bool intersect(const Ray &r, Hit &h, float tmin) override;//TODO:intersect 需要考虑是不是grid？？
+    bool intersect(const Ray &r, Hit &h, float tmin) const override;//TODO:intersect 需要考虑是不是grid？？
 
-    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) override {
+    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) const override {
         for (int i = 0; i < num_objects; i++) {
+            RAYSTAT(group_tests);
             if (objects[i]->intersectShadowRay(r, h, tmin)) return true;
         }
         return false;
     }
 
+    void intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const override {
+        for (int i = 0; i < num_objects; i++) {
+            objects[i]->intersectPacket(r, h, tmin);
+        }
+    }
+
+    int getNumPrimitives() const override {
+        int n = 0;
+        for (int i = 0; i < num_objects; i++) {
+            n += objects[i]->getNumPrimitives();
+        }
+        return n;
+    }
+
     void paint() const override;
 
     void addObject(int index, Object3D *obj) {
@@ -63,6 +136,8 @@ public:
 
     void insertIntoGrid(Grid *g, Matrix *m) override;
 
+    void insertIntoBVH(BVH *bvh) override;
+
     BoundingBox *getBoundingBox() override {
         return boundingBox;
     }
@@ -85,27 +160,28 @@ public:
         center = _centre;
         radius = _radius;
         material = _material;
+        boundingBox = new BoundingBox(center - Vec3f(radius, radius, radius),
+                                      center + Vec3f(radius, radius, radius));
     }
 
-    virtual bool intersect(const Ray &r, Hit &h, float tmin) override;
+    virtual bool intersect(const Ray &r, Hit &h, float tmin) const override;
 
-    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) override {
-        return Sphere::intersect(r, h, tmin);
-    }
+    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) const override;
+
+    void intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const override;
 
     void paint() const override;
 
     void insertIntoGrid(Grid *g, Matrix *m) override;
 
-    BoundingBox *getBoundingBox() override {
-        boundingBox = new BoundingBox(center - Vec3f(radius, radius, radius),
-                                      center + Vec3f(radius, radius, radius));
-        return boundingBox;
-    }
+    BoundingBox *getBoundingBox() override { return boundingBox; }
 
-    ~Sphere() override {}
+    ~Sphere() override { delete boundingBox; }
 
 private:
+    // nearest t in (tmin, tmax), without building the normal
+    bool intersectT(const Ray &r, float tmin, float tmax, float &t) const;
+
     Vec3f center;
     float radius;
 };
@@ -116,15 +192,16 @@ public:
         normal = _normal;
         d = _d;
         material = _material;
+        boundingBox = nullptr;
         d = d / normal.Length();
         normal.Normalize();
     }
 
-    virtual bool intersect(const Ray &r, Hit &h, float tmin) override;
+    virtual bool intersect(const Ray &r, Hit &h, float tmin) const override;
 
-    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) override {
-        return Plane::intersect(r, h, tmin);
-    }
+    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) const override;
+
+    void intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const override;
 
     void paint() const override;
 
@@ -143,27 +220,27 @@ class Triangle : public Object3D {
 public:
     Triangle(Vec3f &_a, Vec3f &_b, Vec3f &_c, Material *_material) : a(_a), b(_b), c(_c) {
         material = _material;
+        e1 = a - b;
+        e2 = a - c;
         Vec3f::Cross3(normal, b - a, c - a);
         normal.Normalize();
         isTriangle = true;
+        boundingBox = new BoundingBox(
+                Vec3f(min(min(a.x(), b.x()), c.x()), min(min(a.y(), b.y()), c.y()), min(min(a.z(), b.z()), c.z())),
+                Vec3f(max(max(a.x(), b.x()), c.x()), max(max(a.y(), b.y()), c.y()), max(max(a.z(), b.z()), c.z())));
     };
 
-    virtual bool intersect(const Ray &r, Hit &h, float tmin) override;
+    virtual bool intersect(const Ray &r, Hit &h, float tmin) const override;
 
-    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) override {
-        return Triangle::intersect(r, h, tmin);
-    }
+    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) const override;
+
+    void intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const override;
 
     void paint() const override;
 
     void insertIntoGrid(Grid *g, Matrix *m) override;
 
-    BoundingBox *getBoundingBox() override {
-        boundingBox = new BoundingBox(
-                Vec3f(min(min(a.x(), b.x()), c.x()), min(min(a.y(), b.y()), c.y()), min(min(a.z(), b.z()), c.z())),
-                Vec3f(max(max(a.x(), b.x()), c.x()), max(max(a.y(), b.y()), c.y()), max(max(a.z(), b.z()), c.z())));
-        return boundingBox;
-    }
+    BoundingBox *getBoundingBox() override { return boundingBox; }
 
     Vec3f getA() { return a; }
 
@@ -171,40 +248,183 @@ public:
 
     Vec3f getC() { return c; }
 
-    ~Triangle() override {};
+    ~Triangle() override { delete boundingBox; };
 
 private:
+    bool intersectT(const Ray &r, float tmin, float tmax, float &t) const;
+
     Vec3f a;
     Vec3f b;
     Vec3f c;
+    // a - b and a - c
+    Vec3f e1;
+    Vec3f e2;
     Vec3f normal;
 };
 
+// ====================================================================
+// ====================================================================
+// the triangles of an OBJ file.  The vertices are shared through an
+// index buffer and the edges every intersection needs are precomputed
+// into separate arrays per component, so a face costs 36 bytes instead
+// of a heap allocated Triangle.
+
+// the arrays of a mesh, owned by it or used in place (from a scene cache)
+struct TriangleMeshData {
+    int num_vertices;
+    int num_faces;
+    const Vec3f *vertices;
+    // three zero based vertex indices per face
+    const int *faces;
+    // e1x, e1y, e1z, e2x, e2y, e2z, num_faces floats each
+    const float *edges;
+    // NULL for flat shading; otherwise one normal per vertex, or with
+    // normal_faces (three indices per face like faces) num_normals
+    // that corners pick from
+    int num_normals;
+    const Vec3f *normals;
+    const int *normal_faces;
+    Vec3f min;
+    Vec3f max;
+};
+
+class TriangleMesh : public Object3D {
+public:
+    // faces holds three zero based vertex indices per face
+    TriangleMesh(vector<Vec3f> &_vertices, vector<int> &_faces, Material *_material);
+
+    // the arrays have to outlive the mesh
+    TriangleMesh(const TriangleMeshData &_data, Material *_material);
+
+    const TriangleMeshData &getData() const { return data; }
+
+    // interpolated normals, for meshes made from vectors: the normals of
+    // an OBJ file with the normal index of every corner, or the area
+    // weighted average of the faces around each vertex
+    void setNormals(vector<Vec3f> &_normals, vector<int> &_normal_faces);
+
+    void smoothNormals();
+
+    bool intersect(const Ray &r, Hit &h, float tmin) const override;
+
+    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) const override;
+
+    void intersectPacket(const RayPacket &r, HitPacket &h, float tmin) const override;
+
+    int getNumFaces() const override { return num_faces; }
+
+    bool intersectFace(int face, const Ray &r, Hit &h, float tmin) const override;
+
+    bool intersectFaceShadowRay(int face, const Ray &r, Hit &h, float tmin) const override;
+
+    void intersectFacePacket(int face, const RayPacket &r, HitPacket &h, float tmin) const override;
+
+    void paint() const override;
+
+    void insertIntoGrid(Grid *g, Matrix *m) override;
+
+    void insertFaceIntoGrid(int face, Grid *g) override;
+
+    BoundingBox getFaceBoundingBox(int face) override;
+
+    void insertIntoBVH(BVH *bvh) override;
+
+    BoundingBox *getBoundingBox() override { return boundingBox; }
+
+    ~TriangleMesh() override { delete boundingBox; }
+
+private:
+    bool intersectT(int face, const Ray &r, float tmin, float tmax, float &t) const;
+
+    Vec3f getVertex(int face, int corner) const { return vertices[faces[3 * face + corner]]; }
+
+    Vec3f getNormal(int face) const;
+
+    // the shading normal at barycentric coordinates beta, gamma
+    Vec3f getNormal(int face, float beta, float gamma) const;
+
+    Vec3f getVertexNormal(int face, int corner) const {
+        return normals[normal_faces != nullptr ? normal_faces[3 * face + corner] : faces[3 * face + corner]];
+    }
+
+    void setData(const TriangleMeshData &_data);
+
+    TriangleMeshData data;
+    int num_faces;
+    const Vec3f *vertices;
+    const int *faces;
+    // a - b and a - c of every face
+    const float *e1x, *e1y, *e1z;
+    const float *e2x, *e2y, *e2z;
+    const Vec3f *normals;
+    const int *normal_faces;
+    // empty when the arrays aren't ours
+    vector<Vec3f> own_vertices;
+    vector<int> own_faces;
+    vector<float> own_edges;
+    vector<Vec3f> own_normals;
+    vector<int> own_normal_faces;
+};
+
 class Transform : public Object3D {
 public:
-    Transform(Matrix &_matrix, Object3D *_object) : matrix(_matrix), object(_object) {
+    Transform(Matrix &_matrix, Object3D *_object) : matrix(_matrix), object(_object), accelerator(nullptr) {
         material = nullptr;
+        // everything the rays need is computed once here, never per ray
+        invertible = matrix.Inverse(inverse);
+        inverse.Transpose(inverseTranspose);
+        affine = matrix.IsAffine() && inverse.IsAffine();
+        boundingBox = computeBoundingBox();
     };
 
-    virtual bool intersect(const Ray &r, Hit &h, float tmin) override;
+    virtual bool intersect(const Ray &r, Hit &h, float tmin) const override;
 
-    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) override {
-        return Transform::intersect(r, h, tmin);
-    }
+    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) const override;
 
     void paint() const override;
 
     void insertIntoGrid(Grid *g, Matrix *m) override;
 
-    BoundingBox *getBoundingBox() override;
+    void insertFaceIntoGrid(int face, Grid *g) override;
+
+    // one primitive of the top level accelerator, with the object
+    // behind it in a bottom level BVH shared with other Transforms
+    void insertIntoBVH(BVH *bvh) override;
 
-    ~Transform() override {}
+    // the BVH rays take in object space instead of the object itself
+    void setAccelerator(BVH *_accelerator) { accelerator = _accelerator; }
+
+    BoundingBox *getBoundingBox() override { return boundingBox; }
+
+    ~Transform() override { delete boundingBox; }
 
 private:
+    BoundingBox *computeBoundingBox();
+
+    Ray toObjectSpace(const Ray &r) const;
+
     Matrix matrix;
+    Matrix inverse;
+    Matrix inverseTranspose;
+    bool invertible;
+    bool affine;
     Object3D *object;
+    BVH *accelerator;
 };
 
+// resolution of -grid auto: cells per primitive (override with
+// -DGRID_AUTO_DENSITY=n), and at most this many cells along an axis
+#ifndef GRID_AUTO_DENSITY
+#define GRID_AUTO_DENSITY 2
+#endif
+#define GRID_AUTO_MAX 512
+
+// cells holding more than this many primitives get a grid of their own,
+// one level deep (override with -DGRID_SUBDIVIDE=n, 0 turns it off)
+#ifndef GRID_SUBDIVIDE
+#define GRID_SUBDIVIDE 32
+#endif
+
 class Grid : public Object3D {
 public:
     Grid(BoundingBox *bb, int _nx, int _ny, int _nz) {
@@ -213,32 +433,128 @@ public:
         nx = _nx;
         ny = _ny;
         nz = _nz;
-        opaque.resize(nx * ny * nz);
+        visualize = false;
+        instances = nullptr;
+        rejected_entries = 0;
+        parent = nullptr;
+        cell_primitives = 0;
     }
 
-    bool intersect(const Ray &r, Hit &h, float tmin) override;
+    bool intersect(const Ray &r, Hit &h, float tmin) const override;
 
-    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) override {}
+    bool intersectShadowRay(const Ray &r, Hit &h, float tmin) const override;
 
     void paint() const override;
 
     Vec3f getGrid() { return Vec3f(nx, ny, nz); }
 
-    void insertIntoThis(int index, Object3D *obj) {
-        opaque[index].push_back(obj);
+    // when set, intersect() returns the first occupied cell with a
+    // false color for its occupancy instead of the geometry inside it
+    void setVisualize(bool _visualize) { visualize = _visualize; }
+
+    // entries are only collected here, build() sorts them into the cells
+    void insertIntoThis(int index, Object3D *obj, int face = 0) {
+        pending.push_back(Entry{index, getPrimitiveId(obj, face)});
+    }
+
+    // call once everything is inserted, before tracing; also moves the
+    // crowded cells into grids of their own
+    void build();
+
+    // inserts a face of obj into every cell overlapped by the box bb
+    void insertBoundingBox(BoundingBox *bb, Object3D *obj, int face = 0);
+
+    // only into the cells the triangle or sphere really overlaps, not
+    // every cell of its bounding box
+    void insertTriangle(const Vec3f &a, const Vec3f &b, const Vec3f &c, Object3D *obj, int face = 0);
+
+    void insertSphere(const Vec3f &center, float radius, Object3D *obj);
+
+    // the cells overlapped by the box min, max, clamped to the grid
+    void getCellRange(const Vec3f &min, const Vec3f &max, int start[3], int end[3]) const;
+
+    void getCellBounds(int i, int j, int k, Vec3f &min, Vec3f &max) const;
+
+    int getIndex(int i, int j, int k) const { return i * ny * nz + j * nz + k; }
+
+    // objects that are not bounded by the grid (planes) are tested
+    // against every ray that passes through the grid
+    void insertUnbounded(Object3D *obj) {
+        unbounded.push_back(getPrimitiveId(obj, 0));
     }
 
     void initializeRayMarch(MarchingInfo &mi, const Ray &r, float tmin) const;
 
     BoundingBox *getBoundingBox() override { return boundingBox; }
 
-    ~Grid() override {}
+    // the bottom level BVHs of the Transforms in the grid
+    BVHInstances *getInstances();
+
+    // occupancy, and what inserting bounding boxes would have given
+    void printStats(FILE *out) const;
+
+    long long getNumOccupiedCells() const;
+
+    long long getNumEntries() const { return cell_entries.size(); }
+
+    // a resolution for num_primitives in the box bb: about
+    // GRID_AUTO_DENSITY cells per primitive, as close to cubes as the
+    // box allows
+    static void chooseResolution(BoundingBox *bb, int num_primitives, int &nx, int &ny, int &nz);
+
+    ~Grid() override;
 
 private:
+    int getPrimitiveId(Object3D *obj, int face);
+
+    bool intersectVisualize(const Ray &r, Hit &h, float tmin) const;
+
+    Vec3f getCellSlack() const;
+
+    int getCellSize(int index) const { return cell_offsets[index + 1] - cell_offsets[index]; }
+
+    // the grid a crowded cell points to, or nullptr; such a cell holds
+    // the single entry -1 - (index into subgrids)
+    Grid *getSubgrid(int index) const {
+        if (cell_offsets[index] == cell_offsets[index + 1] || cell_entries[cell_offsets[index]] >= 0) return nullptr;
+        return subgrids[-1 - cell_entries[cell_offsets[index]]];
+    }
+
+    void subdivide();
+
+    // walks the cells the ray crosses, and the grids of crowded cells;
+    // the ids are those of the top grid, prims its primitives
+    template<bool anyHit>
+    bool march(const Ray &r, Hit &h, float tmin, Mailbox &mailbox, const vector<Primitive> &prims) const;
+
     int nx;
     int ny;
     int nz;
-    vector<vector<Object3D *>> opaque;
+    bool visualize;
+    // cells hold indices into primitives, so rays can mailbox them
+    vector<Primitive> primitives;
+    // id of face 0, the faces of an object get consecutive ids
+    unordered_map<Object3D *, int> primitiveIds;
+    vector<int> unbounded;
+    // cell c holds the primitive ids cell_entries[cell_offsets[c]] up to
+    // cell_entries[cell_offsets[c + 1]], so an empty cell costs 4 bytes
+    vector<uint32_t> cell_offsets;
+    vector<int> cell_entries;
+    // what was inserted, until build()
+    struct Entry {
+        int cell;
+        int id;
+    };
+    vector<Entry> pending;
+    BVHInstances *instances;
+    // cells of bounding boxes the exact overlap tests left out
+    long long rejected_entries;
+    // the grids of crowded cells share the ids (and the mailbox) of the
+    // grid above them, which owns them
+    vector<Grid *> subgrids;
+    Grid *parent;
+    // how many primitives the cell had before it was subdivided
+    int cell_primitives;
 };
 
 #endif
\ No newline at end of file
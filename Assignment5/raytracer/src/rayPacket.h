@@ -0,0 +1,107 @@
+#ifndef RAYTRACER_RAYPACKET_H
+#define RAYTRACER_RAYPACKET_H
+
+#include "ray.h"
+#include "hit.h"
+#include "LAlib/simd.h"
+
+// a packet covers a PACKET_WIDTH x PACKET_HEIGHT block of pixels:
+// 2x2 with 4 lanes, 4x2 with 8 lanes; lane = y * PACKET_WIDTH + x
+#define PACKET_WIDTH (SIMD_WIDTH / 2)
+#define PACKET_HEIGHT 2
+
+// ====================================================================
+// ====================================================================
+// SIMD_WIDTH coherent rays, stored as a structure of arrays
+
+class RayPacket {
+public:
+    RayPacket() {}
+
+    RayPacket(const SimdVec3f &_origin, const SimdVec3f &_direction) :
+            origin(_origin), direction(_direction) {}
+
+    RayPacket(const Ray *rays) {
+        float o[3][SIMD_WIDTH], d[3][SIMD_WIDTH];
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            for (int a = 0; a < 3; a++) {
+                o[a][lane] = rays[lane].getOrigin()[a];
+                d[a][lane] = rays[lane].getDirection()[a];
+            }
+        }
+        origin = SimdVec3f(SimdFloat::load(o[0]), SimdFloat::load(o[1]), SimdFloat::load(o[2]));
+        direction = SimdVec3f(SimdFloat::load(d[0]), SimdFloat::load(d[1]), SimdFloat::load(d[2]));
+    }
+
+    const SimdVec3f &getOrigin() const { return origin; }
+
+    const SimdVec3f &getDirection() const { return direction; }
+
+    Ray getRay(int lane) const {
+        return Ray(Vec3f(origin.x[lane], origin.y[lane], origin.z[lane]),
+                   Vec3f(direction.x[lane], direction.y[lane], direction.z[lane]));
+    }
+
+private:
+    SimdVec3f origin;
+    SimdVec3f direction;
+};
+
+// ====================================================================
+// ====================================================================
+// closest hit of every lane of a RayPacket.  A lane whose t starts at
+// -INFINITY can never be hit, which is how partial packets at the
+// image border switch lanes off.
+
+class HitPacket {
+public:
+    HitPacket() {
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            t[lane] = INFINITY;
+            nx[lane] = ny[lane] = nz[lane] = 0;
+            material[lane] = NULL;
+        }
+    }
+
+    SimdFloat getT() const { return SimdFloat::load(t); }
+
+    // takes the new hit in the lanes where mask is set
+    void update(SimdMask mask, SimdFloat _t, const SimdVec3f &normal, Material *m) {
+        int bits = simdBits(mask);
+        if (bits == 0) return;
+        simdSelect(mask, _t, SimdFloat::load(t)).store(t);
+        simdSelect(mask, normal.x, SimdFloat::load(nx)).store(nx);
+        simdSelect(mask, normal.y, SimdFloat::load(ny)).store(ny);
+        simdSelect(mask, normal.z, SimdFloat::load(nz)).store(nz);
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            if (bits & (1 << lane)) material[lane] = m;
+        }
+    }
+
+    Hit getHit(int lane, const Ray &ray) const {
+        Hit h;
+        h.set(t[lane], material[lane], Vec3f(nx[lane], ny[lane], nz[lane]), ray);
+        return h;
+    }
+
+    void setHit(int lane, const Hit &h) {
+        t[lane] = h.getT();
+        material[lane] = h.getMaterial();
+        nx[lane] = h.getNormal().x();
+        ny[lane] = h.getNormal().y();
+        nz[lane] = h.getNormal().z();
+    }
+
+    void disableLane(int lane) { t[lane] = -INFINITY; }
+
+    bool isEnabled(int lane) const { return t[lane] != -INFINITY; }
+
+private:
+    float t[SIMD_WIDTH];
+    float nx[SIMD_WIDTH];
+    float ny[SIMD_WIDTH];
+    float nz[SIMD_WIDTH];
+    Material *material[SIMD_WIDTH];
+};
+
+#endif //RAYTRACER_RAYPACKET_H
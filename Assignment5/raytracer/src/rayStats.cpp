@@ -0,0 +1,59 @@
+#include "rayStats.h"
+
+thread_local RayStats RayStats::current;
+mutex RayStats::lock;
+RayStats RayStats::sum;
+
+void RayStats::flush() {
+    lock_guard<mutex> guard(lock);
+    sum.add(current);
+    current.clear();
+}
+
+RayStats RayStats::total() {
+    lock_guard<mutex> guard(lock);
+    return sum;
+}
+
+void RayStats::reset() {
+    lock_guard<mutex> guard(lock);
+    sum.clear();
+    current.clear();
+}
+
+static double average(long long a, long long b) {
+    return b > 0 ? double(a) / double(b) : 0.0;
+}
+
+void RayStats::print(FILE *out) const {
+    if (!RAYTRACER_STATS) {
+        fprintf(out, "rays                not counted, build with -DRAYTRACER_STATS=ON\n");
+        return;
+    }
+    long long rays = getRays();
+    long long tests = getIntersectionTests();
+    fprintf(out, "rays                %12lld\n", rays);
+    fprintf(out, "  primary           %12lld\n", primary_rays);
+    fprintf(out, "  shadow            %12lld\n", shadow_rays);
+    fprintf(out, "  reflected         %12lld\n", reflected_rays);
+    fprintf(out, "  transmitted       %12lld\n", transmitted_rays);
+    fprintf(out, "intersection tests  %12lld  %8.2f per ray\n", tests, average(tests, rays));
+    fprintf(out, "  sphere            %12lld\n", sphere_tests);
+    fprintf(out, "  plane             %12lld\n", plane_tests);
+    fprintf(out, "  triangle          %12lld\n", triangle_tests);
+    if (group_tests > 0) {
+        fprintf(out, "group children      %12lld  %8.2f per ray\n", group_tests, average(group_tests, rays));
+    }
+    if (grid_rays > 0) {
+        fprintf(out, "grid cells visited  %12lld  %8.2f per marched ray\n", grid_cells, average(grid_cells, grid_rays));
+    }
+    if (bvh_rays > 0) {
+        fprintf(out, "bvh nodes           %12lld  %8.2f per traversal\n", bvh_nodes, average(bvh_nodes, bvh_rays));
+    }
+    fprintf(out, "bounce depth\n");
+    for (int d = 0; d < RAYSTATS_DEPTHS; d++) {
+        if (depth[d] == 0) continue;
+        fprintf(out, "  %d%s %16lld  %7.2f%%\n", d, d == RAYSTATS_DEPTHS - 1 ? "+" : " ",
+                depth[d], 100.0 * average(depth[d], primary_rays + getSecondaryRays()));
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef RAYTRACER_RAYSTATS_H
+#define RAYTRACER_RAYSTATS_H
+
+#include <stdio.h>
+#include <mutex>
+
+using namespace std;
+
+// ====================================================================
+// counting of rays and intersection tests, opt in with -DRAYTRACER_STATS=1
+// (cmake -DRAYTRACER_STATS=ON); the counts sit in the hot paths
+
+//   0: compiled out, RAYSTAT does nothing and -stats only prints the rest
+//   1: every thread counts into its own RayStats
+#ifndef RAYTRACER_STATS
+#define RAYTRACER_STATS 0
+#endif
+
+// ====================================================================
+
+#if RAYTRACER_STATS
+#define RAYSTAT_ADD(counter, n) (RayStats::local().counter += (n))
+#else
+#define RAYSTAT_ADD(counter, n) ((void) 0)
+#endif
+#define RAYSTAT(counter) RAYSTAT_ADD(counter, 1)
+
+// ====================================================================
+// ====================================================================
+// The counters of one thread.  The hot paths only touch the calling
+// thread's own copy; the renderer calls flush() after every tile to
+// add it to the shared total, so nothing is lost when a worker exits.
+// There is no constructor on purpose: static and thread_local RayStats
+// start out zeroed, and a trivial type spares every count the
+// thread_local initialization check.
+
+// bounce depths 0 .. RAYSTATS_DEPTHS - 2, the last bin takes everything deeper
+#define RAYSTATS_DEPTHS 8
+
+class RayStats {
+public:
+    void clear() { *this = RayStats(); }
+
+    void add(const RayStats &other) {
+        primary_rays += other.primary_rays;
+        shadow_rays += other.shadow_rays;
+        reflected_rays += other.reflected_rays;
+        transmitted_rays += other.transmitted_rays;
+        sphere_tests += other.sphere_tests;
+        plane_tests += other.plane_tests;
+        triangle_tests += other.triangle_tests;
+        group_tests += other.group_tests;
+        grid_rays += other.grid_rays;
+        grid_cells += other.grid_cells;
+        bvh_rays += other.bvh_rays;
+        bvh_nodes += other.bvh_nodes;
+        for (int d = 0; d < RAYSTATS_DEPTHS; d++) {
+            depth[d] += other.depth[d];
+        }
+    }
+
+    long long getSecondaryRays() const { return reflected_rays + transmitted_rays; }
+
+    long long getRays() const { return primary_rays + shadow_rays + getSecondaryRays(); }
+
+    long long getIntersectionTests() const { return sphere_tests + plane_tests + triangle_tests; }
+
+    void print(FILE *out) const;
+
+    // the calling thread's counters
+    static RayStats &local() { return current; }
+
+    // moves the calling thread's counters into the total
+    static void flush();
+
+    static RayStats total();
+
+    // clears the total and the calling thread's counters
+    static void reset();
+
+    long long primary_rays;
+    long long shadow_rays;
+    long long reflected_rays;
+    long long transmitted_rays;
+    // ray-primitive tests, a packet counts once per lane
+    long long sphere_tests;
+    long long plane_tests;
+    long long triangle_tests;
+    // objects a Group tested without an accelerator
+    long long group_tests;
+    // rays marched through the grid and the cells they visited
+    long long grid_rays;
+    long long grid_cells;
+    // rays (or packets) that traversed the BVH and the nodes they visited
+    long long bvh_rays;
+    long long bvh_nodes;
+    // traced rays by bounce depth, 0 for the primary rays
+    long long depth[RAYSTATS_DEPTHS];
+
+private:
+    static thread_local RayStats current;
+    static mutex lock;
+    static RayStats sum;
+};
+
+#endif //RAYTRACER_RAYSTATS_H
@@ -1,6 +1,7 @@
 
 #include "rayTracer.h"
 #include "object3d.h"
+#include "rayStats.h"
 
 //TODO:May be bugs
 
@@ -30,11 +31,38 @@ bool RayTracer::transmittedDirection(const Vec3f &normal, const Vec3f &incoming,
 }
 
 Vec3f RayTracer::traceRay(Ray &ray, float tmin, int bounces, float weight, float indexOfRefraction, Hit &hit) const {
-    Group *group = scene->getGroup();
-    Vec3f color(0.0, 0.0, 0.0);
+    if (!isTraced(bounces, weight))return Vec3f(0.0, 0.0, 0.0);
+    if (bounces == 0) RAYSTAT(primary_rays);
+    RAYSTAT(depth[min(bounces, RAYSTATS_DEPTHS - 1)]);
+    if (!accel->intersect(ray, hit, tmin))return scene->getBackgroundColor();
+    return shade(ray, bounces, weight, indexOfRefraction, hit);
+}
+
+void RayTracer::tracePacket(const RayPacket &packet, float tmin, HitPacket &hits, Vec3f *colors) const {
+    // the same cutoff as traceRay, the hits stay empty
+    if (!isTraced(0, 1.0)) {
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            colors[lane] = Vec3f(0.0, 0.0, 0.0);
+        }
+        return;
+    }
+    accel->intersectPacket(packet, hits, tmin);
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        if (!hits.isEnabled(lane)) continue;
+        RAYSTAT(primary_rays);
+        RAYSTAT(depth[0]);
+        Ray ray = packet.getRay(lane);
+        Hit hit = hits.getHit(lane, ray);
+        if (hit.getMaterial() == nullptr) {
+            colors[lane] = scene->getBackgroundColor();
+        } else {
+            colors[lane] = shade(ray, 0, 1.0, 1.0, hit);
+        }
+    }
+}
 
-    if (bounces > max_bounces || weight < cutoff_weight)return Vec3f(0.0, 0.0, 0.0);
-    if (!group->intersect(ray, hit, tmin))return scene->getBackgroundColor();
+Vec3f RayTracer::shade(Ray &ray, int bounces, float weight, float indexOfRefraction, Hit &hit) const {
+    Vec3f color(0.0, 0.0, 0.0);
     if (bounces == 0) RayTree::SetMainSegment(ray, 0, hit.getT());
 
     Material *material = hit.getMaterial();
@@ -52,8 +80,9 @@ Vec3f RayTracer::traceRay(Ray &ray, float tmin, int bounces, float weight, float
         light->getIllumination(point, dir, col, distanceToLight);
         if (shadows) {
             Ray rayToLight(point, dir);
+            RAYSTAT(shadow_rays);
             Hit hitOfLight(distanceToLight, nullptr, Vec3f(0.0, 0.0, 0.0));
-            inter = group->intersectShadowRay(rayToLight, hitOfLight, epsilon);
+            inter = accel->intersectShadowRay(rayToLight, hitOfLight, epsilon);
             RayTree::AddShadowSegment(rayToLight, 0, hitOfLight.getT());
         }
         if (!inter) {
@@ -68,8 +97,10 @@ Vec3f RayTracer::traceRay(Ray &ray, float tmin, int bounces, float weight, float
         Vec3f mirrorDir = mirrorDirection(hit.getNormal(), ray.getDirection());
         Ray reflectRay(point, mirrorDir);
         Hit reflectHit(INFINITY, nullptr, Vec3f(0.0, 0.0, 0.0));
+        float reflectWeight = weight * reflectiveColor.Length();
+        if (isTraced(bounces + 1, reflectWeight)) RAYSTAT(reflected_rays);
         Vec3f reflectColor = traceRay(reflectRay, epsilon, bounces + 1,
-                                      weight * reflectiveColor.Length(), indexOfRefraction, reflectHit);
+                                      reflectWeight, indexOfRefraction, reflectHit);
         color += reflectColor * reflectiveColor;
         RayTree::AddReflectedSegment(reflectRay, 0, reflectHit.getT());
     }
@@ -92,8 +123,10 @@ Vec3f RayTracer::traceRay(Ray &ray, float tmin, int bounces, float weight, float
         if (!internalReflect) {
             Ray refractRay(point, transmitted);
             Hit refractHit(INFINITY, nullptr, Vec3f(0.0, 0.0, 0.0));
+            float refractWeight = weight * transparentColor.Length();
+            if (isTraced(bounces + 1, refractWeight)) RAYSTAT(transmitted_rays);
             Vec3f refractColor = traceRay(refractRay, epsilon, bounces + 1,
-                                          weight * transparentColor.Length(), index_t, refractHit);
+                                          refractWeight, index_t, refractHit);
             color += refractColor * transparentColor;
             RayTree::AddTransmittedSegment(refractRay, 0, refractHit.getT());
         }
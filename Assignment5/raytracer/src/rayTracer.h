@@ -5,19 +5,31 @@
 #include "rayTree.h"
 #include "light.h"
 #include "object3d.h"
+#include "bvh.h"
 
 #define epsilon 1e-4
 
 class RayTracer {
 public:
     RayTracer(SceneParser *_scene, int _max_bounces, float _cutoff_weight, bool _shadows, bool _shade_back,
-              bool _grid, int _nx, int _ny, int _nz, bool _visualize_grid) :
+              bool _grid, int _nx, int _ny, int _nz, bool _visualize_grid, bool _bvh) :
             scene(_scene), max_bounces(_max_bounces), cutoff_weight(_cutoff_weight), shadows(_shadows),
             shade_back(_shade_back), visualize_grid(_visualize_grid) {
         if (_grid) {
+            // no resolution: pick one from the scene
+            if (_nx <= 0 || _ny <= 0 || _nz <= 0) {
+                Group *group = _scene->getGroup();
+                Grid::chooseResolution(group->getBoundingBox(), group->getNumPrimitives(), _nx, _ny, _nz);
+            }
             grid = new Grid(_scene->getGroup()->getBoundingBox(), _nx, _ny, _nz);
             _scene->getGroup()->insertIntoGrid(grid, nullptr);
+            grid->build();
+            grid->setVisualize(_visualize_grid);
         } else grid = nullptr;
+        // primary, secondary and shadow rays all go through the accelerator
+        if (_bvh) accel = new BVH(_scene->getGroup(), _scene->getCache());
+        else if (grid) accel = grid;
+        else accel = _scene->getGroup();
     }
 
     Vec3f mirrorDirection(const Vec3f &normal, const Vec3f &incoming) const;
@@ -27,7 +39,26 @@ public:
 
     Vec3f traceRay(Ray &ray, float tmin, int bounces, float weight, float indexOfRefraction, Hit &hit) const;
 
+    // primary rays only: intersects the whole packet at once, then shades
+    // (and recurses for) every enabled lane on its own
+    void tracePacket(const RayPacket &packet, float tmin, HitPacket &hits, Vec3f *colors) const;
+
+    Grid *getGrid() const { return grid; }
+
+    ~RayTracer() {
+        if (accel != grid && accel != scene->getGroup()) delete accel;
+        delete grid;
+    }
+
 private:
+    // whether traceRay follows a ray this deep and this faint at all
+    bool isTraced(int bounces, float weight) const {
+        return bounces <= max_bounces && weight >= cutoff_weight;
+    }
+
+    // lighting, shadows, reflection and refraction at an existing hit
+    Vec3f shade(Ray &ray, int bounces, float weight, float indexOfRefraction, Hit &hit) const;
+
     SceneParser *scene;
     int max_bounces;
     float cutoff_weight;
@@ -35,6 +66,7 @@ private:
     bool shade_back;
     Grid *grid;
     bool visualize_grid;
+    Object3D *accel;
 };
 
 #endif //RAYTRACER_RAYTRACER_H
@@ -3,7 +3,7 @@
 
 // ====================================================================
 // Initialize the static variables
-int RayTree::activated = 0;
+thread_local int RayTree::activated = 0;
 Segment RayTree::main_segment;
 SegmentVector RayTree::shadow_segments;
 SegmentVector RayTree::reflected_segments;
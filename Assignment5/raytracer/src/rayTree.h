@@ -189,7 +189,8 @@ class RayTree {
 public:
 
     // most of the time the RayTree is NOT activated, so the segments
-    // are NOT updated
+    // are NOT updated.  the flag is per thread: only the thread that
+    // activated the tree records into it, the render workers never do
     static void Activate() { Clear(); activated = 1; }
     static void Deactivate() { activated = 0; }
 
@@ -238,7 +239,7 @@ private:
     }
 
     // REPRESENTATION
-    static int activated;
+    static thread_local int activated;
     static Segment main_segment;
     static SegmentVector shadow_segments;
     static SegmentVector reflected_segments;
@@ -0,0 +1,39 @@
+#include "sampler.h"
+#include <math.h>
+#include <stdint.h>
+
+float Sampler::random(int i, int j, int n, int dimension) {
+    // a few rounds of the murmur3 finalizer over the four coordinates
+    uint32_t h = 0x9e3779b9u;
+    uint32_t keys[4] = {uint32_t(i), uint32_t(j), uint32_t(n), uint32_t(dimension)};
+    for (uint32_t k: keys) {
+        h ^= k;
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+    }
+    // the top 24 bits, so the result is exactly representable and < 1
+    return float(h >> 8) / float(1 << 24);
+}
+
+UniformSampler::UniformSampler(int _num_samples) : Sampler(_num_samples) {
+    strata = int(ceil(sqrt(float(num_samples))));
+}
+
+Vec2f UniformSampler::getSamplePosition(int, int, int n) const {
+    // with fewer samples than strata, spread them over all of them
+    int s = (long long) n * strata * strata / num_samples;
+    return Vec2f((s % strata + 0.5f) / strata, (s / strata + 0.5f) / strata);
+}
+
+Vec2f JitteredSampler::getSamplePosition(int i, int j, int n) const {
+    int s = (long long) n * strata * strata / num_samples;
+    return Vec2f((s % strata + random(i, j, n, 0)) / strata,
+                 (s / strata + random(i, j, n, 1)) / strata);
+}
+
+Vec2f RandomSampler::getSamplePosition(int i, int j, int n) const {
+    return Vec2f(random(i, j, n, 0), random(i, j, n, 1));
+}
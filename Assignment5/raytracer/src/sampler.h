@@ -0,0 +1,62 @@
+#ifndef RAYTRACER_SAMPLER_H
+#define RAYTRACER_SAMPLER_H
+
+#include "LAlib/vectors.h"
+
+// ====================================================================
+// ====================================================================
+// Where the samples of a pixel go, as offsets in [0, 1) x [0, 1).
+// The random positions are hashed from the pixel and the sample
+// number, so an image comes out the same whatever order (and from
+// whichever thread) its tiles are traced in.
+
+class Sampler {
+public:
+    explicit Sampler(int _num_samples) : num_samples(_num_samples) {}
+
+    virtual ~Sampler() = default;
+
+    int getNumSamples() const { return num_samples; }
+
+    virtual Vec2f getSamplePosition(int i, int j, int n) const = 0;
+
+protected:
+    // a pseudo random number in [0, 1) for sample n of pixel (i, j)
+    static float random(int i, int j, int n, int dimension);
+
+    int num_samples;
+};
+
+// ====================================================================
+// the centers of a k x k grid of strata, k = ceil(sqrt(num_samples))
+
+class UniformSampler : public Sampler {
+public:
+    explicit UniformSampler(int _num_samples);
+
+    Vec2f getSamplePosition(int i, int j, int n) const override;
+
+protected:
+    int strata;
+};
+
+// ====================================================================
+// one random position inside each of the strata
+
+class JitteredSampler : public UniformSampler {
+public:
+    explicit JitteredSampler(int _num_samples) : UniformSampler(_num_samples) {}
+
+    Vec2f getSamplePosition(int i, int j, int n) const override;
+};
+
+// ====================================================================
+
+class RandomSampler : public Sampler {
+public:
+    explicit RandomSampler(int _num_samples) : Sampler(_num_samples) {}
+
+    Vec2f getSamplePosition(int i, int j, int n) const override;
+};
+
+#endif //RAYTRACER_SAMPLER_H
@@ -0,0 +1,291 @@
+#include "sceneCache.h"
+#include <errno.h>
+#include <string.h>
+#include <filesystem>
+#include "bvh.h"
+
+#define SCENECACHE_MAGIC "RTSCENE\n"
+#define SCENECACHE_VERSION 3
+#define SCENECACHE_MAX_PATH 256
+
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_meshes;
+    // of the scene file and the version
+    uint64_t key;
+    // 0 without a BVH
+    uint64_t bvh_nodes;
+    uint64_t bvh_node_bytes;
+    uint64_t bvh_order;
+    uint64_t bvh_primitives;
+    uint64_t size;
+};
+
+// the header is followed by one of these per mesh
+struct SceneCacheMesh {
+    char obj_file[SCENECACHE_MAX_PATH];
+    uint64_t obj_size;
+    int64_t obj_time;
+    int32_t num_vertices;
+    int32_t num_faces;
+    int32_t num_normals;
+    float min[3];
+    float max[3];
+    uint64_t vertices;
+    uint64_t faces;
+    uint64_t edges;
+    // 0 without
+    uint64_t normals;
+    uint64_t normal_faces;
+};
+
+static uint64_t hashBytes(const char *data, size_t size, uint64_t h = 14695981039346656037ull) {
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// the size and modification time of an OBJ file, to notice edits
+static bool fileStamp(const char *name, uint64_t &size, int64_t &time) {
+    error_code error;
+    size = filesystem::file_size(name, error);
+    if (error) return false;
+    time = filesystem::last_write_time(name, error).time_since_epoch().count();
+    return !error;
+}
+
+// whether bytes at offset lie inside a file of size, aligned for use in place
+static bool fits(uint64_t offset, uint64_t bytes, uint64_t size) {
+    return offset % MAPPED_ALIGN == 0 && offset <= size && bytes <= size - offset;
+}
+
+// whether every index of count int triples lies in [0, limit)
+static bool indicesBelow(const int *indices, int count, int limit) {
+    for (size_t i = 0; i < 3 * size_t(count); i++) {
+        if (indices[i] < 0 || indices[i] >= limit) return false;
+    }
+    return true;
+}
+
+// everything a mesh entry points to lies inside the file and its faces
+// only name vertices and normals that are there
+static bool checkMesh(const SceneCacheMesh &mesh, const char *data, uint64_t size) {
+    if (memchr(mesh.obj_file, 0, SCENECACHE_MAX_PATH) == nullptr) return false;
+    if (mesh.num_vertices < 0 || mesh.num_faces < 0 || mesh.num_normals < 0) return false;
+    if (!fits(mesh.vertices, uint64_t(mesh.num_vertices) * sizeof(Vec3f), size) ||
+        !fits(mesh.faces, uint64_t(mesh.num_faces) * 3 * sizeof(int), size) ||
+        !fits(mesh.edges, uint64_t(mesh.num_faces) * 6 * sizeof(float), size))
+        return false;
+    if (!indicesBelow((const int *) (data + mesh.faces), mesh.num_faces, mesh.num_vertices)) return false;
+    if (mesh.normals != 0 && !fits(mesh.normals, uint64_t(mesh.num_normals) * sizeof(Vec3f), size)) return false;
+    if (mesh.normal_faces != 0) {
+        // normals of their own, or else one per vertex
+        if (mesh.normals == 0 || !fits(mesh.normal_faces, uint64_t(mesh.num_faces) * 3 * sizeof(int), size) ||
+            !indicesBelow((const int *) (data + mesh.normal_faces), mesh.num_faces, mesh.num_normals))
+            return false;
+    } else if (mesh.normals != 0 && mesh.num_normals < mesh.num_vertices) {
+        return false;
+    }
+    return true;
+}
+
+static bool checkBVH(const SceneCacheHeader &header, const char *data, uint64_t size) {
+    if (header.bvh_primitives > uint64_t(INT32_MAX)) return false;
+    int num_primitives = header.bvh_primitives;
+    if (!fits(header.bvh_nodes, header.bvh_node_bytes, size) ||
+        !fits(header.bvh_order, uint64_t(num_primitives) * sizeof(int), size))
+        return false;
+    const int *order = (const int *) (data + header.bvh_order);
+    for (int i = 0; i < num_primitives; i++) {
+        if (order[i] < 0 || order[i] >= num_primitives) return false;
+    }
+    return BVH::checkNodes(data + header.bvh_nodes, header.bvh_node_bytes, num_primitives);
+}
+
+SceneCache::SceneCache(const char *_filename, const char *scene_file) :
+        filename(_filename), mapped(nullptr), dirty(false) {
+    MappedFile scene(scene_file);
+    assert(scene.getData() != nullptr);
+    uint32_t version = SCENECACHE_VERSION;
+    key = hashBytes(scene.getData(), scene.getSize(), hashBytes((const char *) &version, sizeof(version)));
+
+    mapped = new MappedFile(filename);
+    const char *data = mapped->getData();
+    uint64_t size = mapped->getSize();
+    bool valid = data != nullptr && size >= sizeof(SceneCacheHeader);
+    const SceneCacheHeader *header = (const SceneCacheHeader *) data;
+    valid = valid && !memcmp(header->magic, SCENECACHE_MAGIC, 8) && header->version == SCENECACHE_VERSION &&
+            header->key == key && header->size == size;
+    // a file of the right size can still have been damaged, the ranges
+    // and indices are used as they are so nothing may point outside it
+    bool damaged = valid && (uint64_t(header->num_meshes) * sizeof(SceneCacheMesh) > size - sizeof(*header) ||
+                             (header->bvh_nodes != 0 && !checkBVH(*header, data, size)));
+    for (uint32_t m = 0; valid && !damaged && m < header->num_meshes; m++) {
+        const SceneCacheMesh &mesh = ((const SceneCacheMesh *) (header + 1))[m];
+        if (!checkMesh(mesh, data, size)) {
+            damaged = true;
+            break;
+        }
+        uint64_t obj_size;
+        int64_t obj_time;
+        valid = fileStamp(mesh.obj_file, obj_size, obj_time) && obj_size == mesh.obj_size && obj_time == mesh.obj_time;
+    }
+    if (damaged) {
+        printf("whoops cache '%s' is damaged, making everything from scratch\n", filename);
+        valid = false;
+    }
+    if (!valid) {
+        delete mapped;
+        mapped = nullptr;
+        dirty = true;
+    }
+}
+
+bool SceneCache::getMesh(const char *obj_file, TriangleMeshData &mesh) {
+    if (mapped == nullptr) return false;
+    const char *data = mapped->getData();
+    const SceneCacheHeader *header = (const SceneCacheHeader *) data;
+    size_t index = meshes.size();
+    const SceneCacheMesh *entry = (const SceneCacheMesh *) (header + 1) + index;
+    if (index >= header->num_meshes || strcmp(entry->obj_file, obj_file) != 0) {
+        dirty = true;
+        return false;
+    }
+    mesh.num_vertices = entry->num_vertices;
+    mesh.num_faces = entry->num_faces;
+    mesh.vertices = (const Vec3f *) (data + entry->vertices);
+    mesh.faces = (const int *) (data + entry->faces);
+    mesh.edges = (const float *) (data + entry->edges);
+    mesh.num_normals = entry->num_normals;
+    mesh.normals = entry->normals != 0 ? (const Vec3f *) (data + entry->normals) : nullptr;
+    mesh.normal_faces = entry->normal_faces != 0 ? (const int *) (data + entry->normal_faces) : nullptr;
+    mesh.min = Vec3f(entry->min[0], entry->min[1], entry->min[2]);
+    mesh.max = Vec3f(entry->max[0], entry->max[1], entry->max[2]);
+    return true;
+}
+
+void SceneCache::addMesh(const char *obj_file, const TriangleMesh *mesh) {
+    assert(strlen(obj_file) < SCENECACHE_MAX_PATH);
+    meshes.push_back(Mesh{obj_file, mesh});
+}
+
+bool SceneCache::getBVH(int num_primitives, const char *&nodes, size_t &node_bytes, const int *&order) const {
+    if (mapped == nullptr) return false;
+    const char *data = mapped->getData();
+    const SceneCacheHeader *header = (const SceneCacheHeader *) data;
+    if (header->bvh_nodes == 0 || header->bvh_primitives != uint64_t(num_primitives)) return false;
+    nodes = data + header->bvh_nodes;
+    node_bytes = header->bvh_node_bytes;
+    order = (const int *) (data + header->bvh_order);
+    return true;
+}
+
+void SceneCache::setBVH(const void *nodes, size_t node_bytes, const int *order, int num_primitives) {
+    bvh_nodes.assign((const char *) nodes, (const char *) nodes + node_bytes);
+    bvh_order.assign(order, order + num_primitives);
+    dirty = true;
+}
+
+bool SceneCache::save() {
+    if (!dirty) return true;
+    // a BVH read from the old file goes into the new one as well
+    const char *cached_nodes = nullptr;
+    size_t cached_node_bytes = 0;
+    const int *cached_order = nullptr;
+    int num_primitives = bvh_order.size();
+    if (bvh_nodes.empty() && mapped != nullptr) {
+        const SceneCacheHeader *header = (const SceneCacheHeader *) mapped->getData();
+        num_primitives = header->bvh_primitives;
+        getBVH(num_primitives, cached_nodes, cached_node_bytes, cached_order);
+    } else {
+        cached_nodes = bvh_nodes.data();
+        cached_node_bytes = bvh_nodes.size();
+        cached_order = bvh_order.data();
+    }
+
+    SceneCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENECACHE_MAGIC, 8);
+    header.version = SCENECACHE_VERSION;
+    header.num_meshes = meshes.size();
+    header.key = key;
+    vector<SceneCacheMesh> entries(meshes.size());
+    uint64_t offset = sizeof(header) + entries.size() * sizeof(SceneCacheMesh);
+    for (size_t m = 0; m < meshes.size(); m++) {
+        const TriangleMeshData &mesh = meshes[m].mesh->getData();
+        SceneCacheMesh &entry = entries[m];
+        memset(&entry, 0, sizeof(entry));
+        strcpy(entry.obj_file, meshes[m].obj_file.c_str());
+        if (!fileStamp(entry.obj_file, entry.obj_size, entry.obj_time)) {
+            printf("whoops can't stat '%s', not writing cache '%s'\n", entry.obj_file, filename);
+            return false;
+        }
+        entry.num_vertices = mesh.num_vertices;
+        entry.num_faces = mesh.num_faces;
+        for (int k = 0; k < 3; k++) {
+            entry.min[k] = mesh.min[k];
+            entry.max[k] = mesh.max[k];
+        }
+        entry.vertices = mappedAlign(offset);
+        entry.faces = mappedAlign(entry.vertices + uint64_t(mesh.num_vertices) * sizeof(Vec3f));
+        entry.edges = mappedAlign(entry.faces + uint64_t(mesh.num_faces) * 3 * sizeof(int));
+        offset = entry.edges + uint64_t(mesh.num_faces) * 6 * sizeof(float);
+        if (mesh.normals != nullptr) {
+            entry.num_normals = mesh.num_normals;
+            entry.normals = mappedAlign(offset);
+            offset = entry.normals + uint64_t(mesh.num_normals) * sizeof(Vec3f);
+        }
+        if (mesh.normal_faces != nullptr) {
+            entry.normal_faces = mappedAlign(offset);
+            offset = entry.normal_faces + uint64_t(mesh.num_faces) * 3 * sizeof(int);
+        }
+    }
+    if (cached_nodes != nullptr) {
+        header.bvh_nodes = mappedAlign(offset);
+        header.bvh_node_bytes = cached_node_bytes;
+        header.bvh_order = mappedAlign(header.bvh_nodes + cached_node_bytes);
+        header.bvh_primitives = num_primitives;
+        offset = header.bvh_order + uint64_t(num_primitives) * sizeof(int);
+    }
+    header.size = offset;
+
+    filesystem::path part(filename);
+    part += ".part";
+    FILE *file = fopen(part.string().c_str(), "wb");
+    if (file == NULL) {
+        printf("whoops can't write cache '%s': %s\n", part.string().c_str(), strerror(errno));
+        return false;
+    }
+    bool written = writeAt(file, 0, &header, sizeof(header)) &&
+                   writeAt(file, sizeof(header), entries.data(), entries.size() * sizeof(SceneCacheMesh));
+    for (size_t m = 0; written && m < meshes.size(); m++) {
+        const TriangleMeshData &mesh = meshes[m].mesh->getData();
+        const SceneCacheMesh &entry = entries[m];
+        written = writeAt(file, entry.vertices, mesh.vertices, uint64_t(mesh.num_vertices) * sizeof(Vec3f)) &&
+                  writeAt(file, entry.faces, mesh.faces, uint64_t(mesh.num_faces) * 3 * sizeof(int)) &&
+                  writeAt(file, entry.edges, mesh.edges, uint64_t(mesh.num_faces) * 6 * sizeof(float)) &&
+                  (entry.normals == 0 ||
+                   writeAt(file, entry.normals, mesh.normals, uint64_t(mesh.num_normals) * sizeof(Vec3f))) &&
+                  (entry.normal_faces == 0 ||
+                   writeAt(file, entry.normal_faces, mesh.normal_faces, uint64_t(mesh.num_faces) * 3 * sizeof(int)));
+    }
+    if (written && cached_nodes != nullptr) {
+        written = writeAt(file, header.bvh_nodes, cached_nodes, cached_node_bytes) &&
+                  writeAt(file, header.bvh_order, cached_order, uint64_t(num_primitives) * sizeof(int));
+    }
+    written = fclose(file) == 0 && written;
+    // the meshes keep using the old file, which stays mapped until we
+    // go; a short file must not replace it
+    error_code error;
+    if (written) filesystem::rename(part, filename, error);
+    if (!written || error) {
+        printf("whoops can't write cache '%s', keeping the old one\n", filename);
+        filesystem::remove(part, error);
+        return false;
+    }
+    dirty = false;
+    return true;
+}
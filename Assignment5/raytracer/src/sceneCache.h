@@ -0,0 +1,61 @@
+#ifndef RAYTRACER_SCENECACHE_H
+#define RAYTRACER_SCENECACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "object3d.h"
+#include "mappedFile.h"
+
+using namespace std;
+
+// ====================================================================
+// ====================================================================
+// A binary file next to a scene with what is slow to make from it: the
+// arrays of every TriangleMesh, which are used straight from the mapped
+// file, and the nodes of the BVH with the order of its primitives.  The
+// scene file itself is small and is still parsed every time.  The cache
+// belongs to one scene file and the OBJ files it names; when either has
+// changed it is ignored, and whatever was made from scratch is written
+// back by save().  The file stays mapped as long as the cache lives, so
+// it has to outlive the scene.
+
+class SceneCache {
+public:
+    SceneCache(const char *_filename, const char *scene_file);
+
+    ~SceneCache() { delete mapped; }
+
+    // the next mesh of the scene, if the cache has it for obj_file
+    bool getMesh(const char *obj_file, TriangleMeshData &mesh);
+
+    // every mesh of the scene in order, from the cache or not
+    void addMesh(const char *obj_file, const TriangleMesh *mesh);
+
+    // a BVH over num_primitives primitives: the raw nodes, and for every
+    // leaf primitive its position in the order they were inserted
+    bool getBVH(int num_primitives, const char *&nodes, size_t &node_bytes, const int *&order) const;
+
+    void setBVH(const void *nodes, size_t node_bytes, const int *order, int num_primitives);
+
+    // rewrites the file if anything had to be made from scratch; false
+    // (and the old file left alone) if it couldn't be written
+    bool save();
+
+private:
+    struct Mesh {
+        string obj_file;
+        const TriangleMesh *mesh;
+    };
+
+    const char *filename;
+    uint64_t key;
+    // NULL when there is no usable cache
+    MappedFile *mapped;
+    vector<Mesh> meshes;
+    vector<char> bvh_nodes;
+    vector<int> bvh_order;
+    bool dirty;
+};
+
+#endif //RAYTRACER_SCENECACHE_H
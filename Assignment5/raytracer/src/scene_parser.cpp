@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 
 #include "scene_parser.h"
 #include "LAlib/matrix.h"
@@ -7,6 +8,8 @@
 #include "light.h"
 #include "material.h"
 #include "object3d.h"
+#include "objLoader.h"
+#include "sceneCache.h"
 
 #define DegreesToRadians(x) ((M_PI * x) / 180.0f)
 
@@ -14,7 +17,7 @@
 // ====================================================================
 // CONSTRUCTOR & DESTRUCTOR
 
-SceneParser::SceneParser(const char *filename) {
+SceneParser::SceneParser(const char *filename, const char *cache_file) {
 
     // initialize some reasonable default values
     group = NULL;
@@ -26,11 +29,13 @@ SceneParser::SceneParser(const char *filename) {
     num_materials = 0;
     materials = NULL;
     current_material = NULL;
+    cache = cache_file != NULL ? new SceneCache(cache_file, filename) : NULL;
 
     // parse the file
     assert(filename != NULL);
     const char *ext = &filename[strlen(filename) - 4];
     assert(!strcmp(ext, ".txt"));
+    files.push_back(filename);
     file = fopen(filename, "r");
     assert (file != NULL);
     parseFile();
@@ -59,6 +64,11 @@ SceneParser::~SceneParser() {
         delete lights[i];
     }
     delete[] lights;
+    for (Object3D *object: instance_objects) {
+        delete object;
+    }
+    // the meshes may still be using its arrays until here
+    delete cache;
 }
 
 // ====================================================================
@@ -318,6 +328,34 @@ Object3D *SceneParser::parseObject(char token[MAX_PARSER_TOKEN_LENGTH]) {
     return answer;
 }
 
+Object3D *SceneParser::parseInstance(char token[MAX_PARSER_TOKEN_LENGTH]) {
+    // the text up to the matching brace, tokens one space apart
+    long start = ftell(file);
+    string text = token;
+    char next[MAX_PARSER_TOKEN_LENGTH];
+    int depth = 0;
+    do {
+        getToken(next);
+        assert (next[0] != '\0');
+        if (!strcmp(next, "{")) depth++;
+        else if (!strcmp(next, "}")) depth--;
+        text += ' ';
+        text += next;
+    } while (depth > 0);
+
+    pair<string, Material *> key(text, current_material);
+    auto found = instances.find(key);
+    if (found != instances.end()) {
+        current_material = found->second.material;
+        return found->second.object;
+    }
+    fseek(file, start, SEEK_SET);
+    Object3D *answer = parseObject(token);
+    instances[key] = Instance{answer, current_material};
+    instance_objects.push_back(answer);
+    return answer;
+}
+
 // ====================================================================
 // ====================================================================
 
@@ -420,7 +458,7 @@ Triangle *SceneParser::parseTriangle() {
     return new Triangle(v0, v1, v2, current_material);
 }
 
-Group *SceneParser::parseTriangleMesh() {
+TriangleMesh *SceneParser::parseTriangleMesh() {
     char token[MAX_PARSER_TOKEN_LENGTH];
     char filename[MAX_PARSER_TOKEN_LENGTH];
     // get the filename
@@ -429,67 +467,50 @@ Group *SceneParser::parseTriangleMesh() {
     getToken(token);
     assert (!strcmp(token, "obj_file"));
     getToken(filename);
+    // normals are interpolated if the OBJ file has them, or with
+    // smooth from the faces around each vertex
+    bool smooth = false;
     getToken(token);
+    if (!strcmp(token, "smooth")) {
+        smooth = true;
+        getToken(token);
+    }
     assert (!strcmp(token, "}"));
     const char *ext = &filename[strlen(filename) - 4];
     assert(!strcmp(ext, ".obj"));
-    // read it once, get counts
-    FILE *file = fopen(filename, "r");
-    assert (file != NULL);
-    int vcount = 0;
-    int fcount = 0;
-    while (1) {
-        int c = fgetc(file);
-        if (c == EOF) {
-            break;
-        } else if (c == 'v') {
-            assert(fcount == 0);
-            float v0, v1, v2;
-            fscanf(file, "%f %f %f", &v0, &v1, &v2);
-            vcount++;
-        } else if (c == 'f') {
-            int f0, f1, f2;
-            fscanf(file, "%d %d %d", &f0, &f1, &f2);
-            fcount++;
-        } // otherwise, must be whitespace
+    assert (current_material != NULL);
+    string key = string(filename) + (smooth ? " smooth" : "");
+    TriangleMesh *answer;
+    if (meshes.count(key)) {
+        // a file read before only costs a TriangleMesh over its arrays
+        answer = new TriangleMesh(meshes[key]->getData(), current_material);
+    } else {
+        answer = loadTriangleMesh(filename, smooth);
+        meshes[key] = answer;
     }
-    fclose(file);
-    // make arrays
-    Vec3f *verts = new Vec3f[vcount];
-    Group *answer = new Group(fcount);
-    // read it again, save it
-    file = fopen(filename, "r");
-    assert (file != NULL);
-    int new_vcount = 0;
-    int new_fcount = 0;
-    while (1) {
-        int c = fgetc(file);
-        if (c == EOF) {
-            break;
-        } else if (c == 'v') {
-            assert(new_fcount == 0);
-            float v0, v1, v2;
-            fscanf(file, "%f %f %f", &v0, &v1, &v2);
-            verts[new_vcount] = Vec3f(v0, v1, v2);
-            new_vcount++;
-        } else if (c == 'f') {
-            assert (vcount == new_vcount);
-            int f0, f1, f2;
-            fscanf(file, "%d %d %d", &f0, &f1, &f2);
-            // indexed starting at 1...
-            assert (f0 > 0 && f0 <= vcount);
-            assert (f1 > 0 && f1 <= vcount);
-            assert (f2 > 0 && f2 <= vcount);
-            assert (current_material != NULL);
-            Triangle *t = new Triangle(verts[f0 - 1], verts[f1 - 1], verts[f2 - 1], current_material);
-            answer->addObject(new_fcount, t);
-            new_fcount++;
-        } // otherwise, must be whitespace
+    return answer;
+}
+
+TriangleMesh *SceneParser::loadTriangleMesh(const char *filename, bool smooth) {
+    files.push_back(filename);
+    TriangleMeshData data;
+    if (cache != NULL && cache->getMesh(filename, data)) {
+        TriangleMesh *answer = new TriangleMesh(data, current_material);
+        cache->addMesh(filename, answer);
+        return answer;
     }
-    delete[] verts;
-    assert (fcount == new_fcount);
-    assert (vcount == new_vcount);
-    fclose(file);
+    ObjMesh obj;
+    loadObj(filename, obj);
+    // a normal for every corner or none at all
+    bool normals = !obj.face_normals.empty() &&
+                   find(obj.face_normals.begin(), obj.face_normals.end(), -1) == obj.face_normals.end();
+    TriangleMesh *answer = new TriangleMesh(obj.vertices, obj.faces, current_material);
+    if (normals) {
+        answer->setNormals(obj.normals, obj.face_normals);
+    } else if (smooth) {
+        answer->smoothNormals();
+    }
+    if (cache != NULL) cache->addMesh(filename, answer);
     return answer;
 }
 
@@ -544,7 +565,7 @@ Transform *SceneParser::parseTransform() {
         } else {
             // otherwise this must be an object,
             // and there are no more transformations
-            object = parseObject(token);
+            object = parseInstance(token);
             break;
         }
         getToken(token);
@@ -3,6 +3,12 @@
 
 #include "LAlib/vectors.h"
 #include <assert.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
 
 class Camera;
 
@@ -20,8 +26,12 @@ class Plane;
 
 class Triangle;
 
+class TriangleMesh;
+
 class Transform;
 
+class SceneCache;
+
 #define MAX_PARSER_TOKEN_LENGTH 100
 
 // ====================================================================
@@ -32,7 +42,9 @@ class SceneParser {
 public:
 
     // CONSTRUCTOR & DESTRUCTOR
-    SceneParser(const char *filename);
+    // with a cache_file the meshes (and the BVH) are taken from it when
+    // it is up to date, and it is written when it isn't
+    SceneParser(const char *filename, const char *cache_file = NULL);
 
     ~SceneParser();
 
@@ -59,6 +71,12 @@ public:
 
     Group *getGroup() const { return group; }
 
+    SceneCache *getCache() const { return cache; }
+
+    // every file the scene was read from, the scene file first and then
+    // the OBJ files
+    const vector<string> &getFiles() const { return files; }
+
 private:
 
     SceneParser() { assert(0); } // don't use
@@ -84,6 +102,10 @@ private:
 
     Object3D *parseObject(char token[MAX_PARSER_TOKEN_LENGTH]);
 
+    // the object of a Transform, which is shared with every Transform
+    // whose object has the same text and starts with the same material
+    Object3D *parseInstance(char token[MAX_PARSER_TOKEN_LENGTH]);
+
     Group *parseGroup();
 
     Sphere *parseSphere();
@@ -92,7 +114,9 @@ private:
 
     Triangle *parseTriangle();
 
-    Group *parseTriangleMesh();
+    TriangleMesh *parseTriangleMesh();
+
+    TriangleMesh *loadTriangleMesh(const char *filename, bool smooth);
 
     Transform *parseTransform();
 
@@ -119,6 +143,18 @@ private:
     Material **materials;
     Material *current_material;
     Group *group;
+    SceneCache *cache;
+    // the first mesh made from every OBJ file (and smooth or not), and
+    // the objects shared by Transforms, which belong to the parser
+    unordered_map<string, TriangleMesh *> meshes;
+    struct Instance {
+        Object3D *object;
+        // the material after its text, its MaterialIndex apply to what follows
+        Material *material;
+    };
+    map<pair<string, Material *>, Instance> instances;
+    vector<Object3D *> instance_objects;
+    vector<string> files;
 };
 
 // ====================================================================
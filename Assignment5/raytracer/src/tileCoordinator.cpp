@@ -0,0 +1,474 @@
+#include "tileCoordinator.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#ifndef _WIN32
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// tiles a worker is given before it has sent back the first one
+#define COORDINATOR_IN_FLIGHT 2
+// a tile is handed out again after this many times the average tile
+// time, but never sooner than COORDINATOR_MIN_TIMEOUT seconds
+#define COORDINATOR_TIMEOUT_FACTOR 4
+#define COORDINATOR_MIN_TIMEOUT 0.5
+
+#ifndef _WIN32
+
+enum MessageType : uint32_t {
+    MESSAGE_HELLO = 1,      // worker: settings, floats per pixel
+    MESSAGE_TILE = 2,       // coordinator: TileMessage
+    MESSAGE_RESULT = 3,     // worker: TileMessage, then the floats of the tile
+    MESSAGE_DONE = 4        // coordinator: no more tiles
+};
+
+struct MessageHeader {
+    uint32_t type;
+    uint32_t size;      // of the payload, in bytes
+};
+
+struct HelloMessage {
+    uint64_t settings;
+    uint32_t floats_per_pixel;
+    uint32_t pad;
+};
+
+struct TileMessage {
+    int32_t id;
+    int32_t x0, y0;
+    int32_t x1, y1;
+};
+
+static bool sendAll(int fd, const void *data, size_t size) {
+    const char *p = (const char *) data;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool receiveAll(int fd, void *data, size_t size) {
+    char *p = (char *) data;
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool sendMessage(int fd, uint32_t type, const void *payload, uint32_t size,
+                        const void *extra = nullptr, uint32_t extra_size = 0) {
+    MessageHeader header = {type, size + extra_size};
+    return sendAll(fd, &header, sizeof(header)) && sendAll(fd, payload, size) &&
+           (extra_size == 0 || sendAll(fd, extra, extra_size));
+}
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// ====================================================================
+// ====================================================================
+
+namespace {
+
+struct Job {
+    TileScheduler::Tile tile;
+    bool done;
+    int copies;     // workers it is out with
+    chrono::steady_clock::time_point start;
+};
+
+struct Connection {
+    int fd;
+    bool ready;     // said hello with the right settings
+    vector<int> tiles;
+    vector<char> buffer;
+    // the last result, or when it was last given a tile while it had none
+    chrono::steady_clock::time_point heard;
+};
+
+}
+
+void TileCoordinator::run(const char *address, int num_local_workers, int num_threads, const TraceFunction &trace,
+                          const ResultFunction &result) {
+    // the loopback interface unless the host says otherwise
+    string host = "127.0.0.1";
+    string port = "0";
+    if (address != NULL) {
+        port = address;
+        size_t colon = port.rfind(':');
+        if (colon != string::npos) {
+            host = port.substr(0, colon);
+            port = port.substr(colon + 1);
+        }
+    }
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *info;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &info) != 0) {
+        printf("whoops can't resolve '%s'\n", host.c_str());
+        assert(0);
+    }
+    int listener = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    assert(listener >= 0);
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (bind(listener, info->ai_addr, info->ai_addrlen) != 0 || listen(listener, 64) != 0) {
+        printf("whoops can't listen on %s:%s: %s\n", host.c_str(), port.c_str(), strerror(errno));
+        assert(0);
+    }
+    freeaddrinfo(info);
+    sockaddr_in bound;
+    socklen_t length = sizeof(bound);
+    getsockname(listener, (sockaddr *) &bound, &length);
+    int listen_port = ntohs(bound.sin_port);
+    if (num_local_workers == 0) {
+        printf("coordinator: waiting for workers on %s:%d\n", host.c_str(), listen_port);
+    }
+
+    // the children share the scene with us, copy on write
+    fflush(stdout);
+    vector<pid_t> children;
+    string local = "127.0.0.1:" + to_string(listen_port);
+    for (int k = 0; k < num_local_workers; k++) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            close(listener);
+            work(local.c_str(), floats_per_pixel, settings, trace);
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+
+    vector<Job> jobs;
+    for (int y = 0; y < height; y += tile_size) {
+        for (int x = 0; x < width; x += tile_size) {
+            TileScheduler::Tile tile = {x, y, min(x + tile_size, width), min(y + tile_size, height)};
+            jobs.push_back(Job{tile, false, 0, {}});
+        }
+    }
+    deque<int> queue;
+    for (int id = 0; id < int(jobs.size()); id++) {
+        queue.push_back(id);
+    }
+    int remaining = jobs.size();
+    // the largest message a worker has any business sending
+    size_t max_message = sizeof(TileMessage) + size_t(tile_size) * tile_size * floats_per_pixel * sizeof(float);
+    double tile_seconds = 0;
+    int timed_tiles = 0;
+    vector<Connection> connections;
+
+    auto finish = [&](int id, const float *data) {
+        Job &job = jobs[id];
+        if (job.done) return;
+        result(job.tile, data);
+        job.done = true;
+        remaining--;
+        tile_seconds += secondsSince(job.start);
+        timed_tiles++;
+    };
+
+    // how long a tile may be out before it counts as suspiciously slow
+    auto tileTimeout = [&]() {
+        double timeout = timed_tiles > 0 ? COORDINATOR_TIMEOUT_FACTOR * tile_seconds / timed_tiles : 0;
+        return timeout < COORDINATOR_MIN_TIMEOUT ? COORDINATOR_MIN_TIMEOUT : timeout;
+    };
+
+    // the next queued tile, or else one that is taking suspiciously long
+    auto nextTile = [&](const Connection &connection) {
+        while (!queue.empty()) {
+            int id = queue.front();
+            queue.pop_front();
+            if (!jobs[id].done) return id;
+        }
+        double timeout = tileTimeout();
+        int slowest = -1;
+        for (int id = 0; id < int(jobs.size()); id++) {
+            const Job &job = jobs[id];
+            if (job.done || job.copies != 1 || secondsSince(job.start) < timeout) continue;
+            if (find(connection.tiles.begin(), connection.tiles.end(), id) != connection.tiles.end()) continue;
+            if (slowest < 0 || job.start < jobs[slowest].start) slowest = id;
+        }
+        return slowest;
+    };
+
+    auto drop = [&](size_t k) {
+        Connection &connection = connections[k];
+        for (int id: connection.tiles) {
+            Job &job = jobs[id];
+            job.copies--;
+            if (!job.done && job.copies == 0) queue.push_front(id);
+        }
+        close(connection.fd);
+        connections.erase(connections.begin() + k);
+    };
+
+    while (remaining > 0) {
+        // a worker that has had tiles out for that long without sending
+        // any back may hang, it gets no more and doesn't count as ready
+        double timeout = tileTimeout();
+        bool any_ready = false;
+        for (size_t k = 0; k < connections.size(); k++) {
+            Connection &connection = connections[k];
+            if (!connection.ready) continue;
+            if (!connection.tiles.empty() && secondsSince(connection.heard) >= timeout) continue;
+            any_ready = true;
+            if (connection.tiles.empty()) connection.heard = chrono::steady_clock::now();
+            while (connection.tiles.size() < COORDINATOR_IN_FLIGHT) {
+                int id = nextTile(connection);
+                if (id < 0) break;
+                Job &job = jobs[id];
+                const TileScheduler::Tile &tile = job.tile;
+                TileMessage message = {id, tile.x0, tile.y0, tile.x1, tile.y1};
+                if (job.copies == 0) job.start = chrono::steady_clock::now();
+                job.copies++;
+                connection.tiles.push_back(id);
+                if (!sendMessage(connection.fd, MESSAGE_TILE, &message, sizeof(message))) break;
+            }
+        }
+
+        // nobody to hand tiles to, so trace one per thread here and look
+        // again.  The same for a tile that is suspiciously slow when no
+        // other worker took a copy of it (the one that has it may hang,
+        // and be the only one), or when the copies are all twice as late
+        vector<int> ids;
+        if (!any_ready) {
+            while (int(ids.size()) < max(num_threads, 1) && !queue.empty()) {
+                int id = queue.front();
+                queue.pop_front();
+                if (!jobs[id].done) ids.push_back(id);
+            }
+        }
+        if (ids.empty() && queue.empty()) {
+            for (int id = 0; id < int(jobs.size()) && int(ids.size()) < max(num_threads, 1); id++) {
+                const Job &job = jobs[id];
+                if (job.done || job.copies == 0) continue;
+                double seconds = secondsSince(job.start);
+                if ((job.copies == 1 && seconds >= timeout) || seconds >= 2 * timeout) ids.push_back(id);
+            }
+        }
+        if (!ids.empty()) {
+            vector<vector<float>> data(ids.size());
+            auto traceJob = [&](size_t k) {
+                const TileScheduler::Tile &tile = jobs[ids[k]].tile;
+                data[k].resize(size_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * floats_per_pixel);
+                trace(tile, data[k].data());
+            };
+            auto start = chrono::steady_clock::now();
+            vector<thread> threads;
+            for (size_t k = 1; k < ids.size(); k++) {
+                threads.emplace_back(traceJob, k);
+            }
+            if (!ids.empty()) traceJob(0);
+            for (thread &t: threads) {
+                t.join();
+            }
+            for (size_t k = 0; k < ids.size(); k++) {
+                // a late tile's time is what it took here, not how long it
+                // waited for a worker
+                jobs[ids[k]].start = start;
+                finish(ids[k], data[k].data());
+            }
+        }
+
+        vector<pollfd> fds(connections.size() + 1);
+        fds[0] = pollfd{listener, POLLIN, 0};
+        for (size_t k = 0; k < connections.size(); k++) {
+            fds[k + 1] = pollfd{connections[k].fd, POLLIN, 0};
+        }
+        int timeout_ms = !any_ready && !queue.empty() ? 0 : 100;
+        if (poll(fds.data(), fds.size(), timeout_ms) < 0) continue;
+
+        // from the back, so dropping a connection doesn't shift the rest
+        for (size_t k = connections.size(); k-- > 0;) {
+            if (fds[k + 1].revents == 0) continue;
+            Connection &connection = connections[k];
+            char chunk[1 << 16];
+            ssize_t n = recv(connection.fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                drop(k);
+                continue;
+            }
+            connection.buffer.insert(connection.buffer.end(), chunk, chunk + n);
+
+            bool bad = false;
+            size_t used = 0;
+            while (!bad && connection.buffer.size() - used >= sizeof(MessageHeader)) {
+                MessageHeader header;
+                memcpy(&header, &connection.buffer[used], sizeof(header));
+                // don't wait for (and buffer) a payload no tile can fill
+                if (header.size > max_message) {
+                    bad = true;
+                    break;
+                }
+                if (connection.buffer.size() - used - sizeof(header) < header.size) break;
+                const char *payload = &connection.buffer[used + sizeof(header)];
+                used += sizeof(header) + header.size;
+
+                if (header.type == MESSAGE_HELLO && header.size == sizeof(HelloMessage)) {
+                    HelloMessage hello;
+                    memcpy(&hello, payload, sizeof(hello));
+                    if (hello.settings != settings || int(hello.floats_per_pixel) != floats_per_pixel) {
+                        printf("coordinator: turned away a worker rendering another scene or other options\n");
+                        bad = true;
+                    } else {
+                        connection.ready = true;
+                    }
+                } else if (header.type == MESSAGE_RESULT && connection.ready && header.size >= sizeof(TileMessage)) {
+                    TileMessage message;
+                    memcpy(&message, payload, sizeof(message));
+                    // only tiles this worker was given, with the right size
+                    auto it = find(connection.tiles.begin(), connection.tiles.end(), message.id);
+                    if (it == connection.tiles.end()) {
+                        bad = true;
+                        break;
+                    }
+                    const TileScheduler::Tile &tile = jobs[message.id].tile;
+                    size_t floats = size_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * floats_per_pixel;
+                    if (header.size != sizeof(message) + floats * sizeof(float)) {
+                        bad = true;
+                        break;
+                    }
+                    connection.tiles.erase(it);
+                    connection.heard = chrono::steady_clock::now();
+                    jobs[message.id].copies--;
+                    // the payload isn't aligned for floats in the buffer
+                    vector<float> data(floats);
+                    memcpy(data.data(), payload + sizeof(message), floats * sizeof(float));
+                    finish(message.id, data.data());
+                } else {
+                    bad = true;
+                }
+            }
+            if (bad) {
+                drop(k);
+                continue;
+            }
+            connection.buffer.erase(connection.buffer.begin(), connection.buffer.begin() + used);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                connections.push_back(Connection{fd, false, {}, {}, chrono::steady_clock::now()});
+            }
+        }
+    }
+
+    for (Connection &connection: connections) {
+        sendMessage(connection.fd, MESSAGE_DONE, nullptr, 0);
+        close(connection.fd);
+    }
+    close(listener);
+    // a worker that hung with a tile someone else finished won't ever
+    // read the done message, and the image is complete anyway
+    for (pid_t pid: children) {
+        pid_t reaped = 0;
+        for (int attempt = 0; attempt < 10 && (reaped = waitpid(pid, nullptr, WNOHANG)) == 0; attempt++) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        if (reaped == 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+    }
+}
+
+void TileCoordinator::work(const char *address, int floats_per_pixel, uint64_t settings, const TraceFunction &trace) {
+    string host(address);
+    size_t colon = host.rfind(':');
+    if (colon == string::npos) {
+        printf("whoops '%s' is not host:port\n", address);
+        assert(0);
+    }
+    string port = host.substr(colon + 1);
+    host = host.substr(0, colon);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *info;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0) {
+        printf("whoops can't resolve '%s'\n", address);
+        assert(0);
+    }
+    // the coordinator may not be up yet, keep trying for a while
+    int fd = -1;
+    for (int attempt = 0; attempt < 100 && fd < 0; attempt++) {
+        fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        assert(fd >= 0);
+        if (connect(fd, info->ai_addr, info->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+    }
+    freeaddrinfo(info);
+    if (fd < 0) {
+        printf("whoops can't connect to the coordinator at %s\n", address);
+        fflush(stdout);
+        return;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    HelloMessage hello = {settings, uint32_t(floats_per_pixel), 0};
+    if (!sendMessage(fd, MESSAGE_HELLO, &hello, sizeof(hello))) {
+        close(fd);
+        return;
+    }
+    vector<float> data;
+    MessageHeader header;
+    while (receiveAll(fd, &header, sizeof(header)) && header.type == MESSAGE_TILE) {
+        TileMessage message;
+        if (header.size != sizeof(message) || !receiveAll(fd, &message, sizeof(message))) break;
+        TileScheduler::Tile tile = {message.x0, message.y0, message.x1, message.y1};
+        data.resize(size_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * floats_per_pixel);
+        trace(tile, data.data());
+        if (!sendMessage(fd, MESSAGE_RESULT, &message, sizeof(message), data.data(), data.size() * sizeof(float)))
+            break;
+    }
+    close(fd);
+}
+
+#else
+
+void TileCoordinator::run(const char *address, int num_local_workers, int num_threads, const TraceFunction &trace,
+                          const ResultFunction &result) {
+    printf("whoops distributed rendering needs POSIX sockets\n");
+    assert(0);
+}
+
+void TileCoordinator::work(const char *address, int floats_per_pixel, uint64_t settings, const TraceFunction &trace) {
+    printf("whoops distributed rendering needs POSIX sockets\n");
+    assert(0);
+}
+
+#endif
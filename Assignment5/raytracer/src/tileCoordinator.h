@@ -0,0 +1,59 @@
+#ifndef RAYTRACER_TILECOORDINATOR_H
+#define RAYTRACER_TILECOORDINATOR_H
+
+#include <stdint.h>
+#include <functional>
+#include "tileScheduler.h"
+
+using namespace std;
+
+// ====================================================================
+// ====================================================================
+// Renders the tiles of an image in worker processes.  The coordinator
+// listens on a TCP port (of the loopback interface unless it is given
+// an address), forks num_local_workers workers of its own
+// (they inherit the loaded scene and acceleration structure) and
+// accepts any number of remote ones started with -connect, which load
+// the scene themselves.  Every worker keeps two tiles in flight.
+// The tiles of a worker whose connection drops go back to the queue;
+// once the queue is empty, a tile that has been out much longer than
+// tiles usually take is handed to an idle worker as well, and the
+// first result to come back wins.  A worker that has sent nothing back
+// for that long stops getting tiles.  While no worker is connected (or
+// all of them are that late) the coordinator traces tiles itself, one
+// per thread, and so it does with a late tile nobody else can take.
+//
+// A tile travels as floats_per_pixel floats per pixel, row by row,
+// their meaning is up to the trace and result functions.  A worker
+// whose settings hash differs from the coordinator's is turned away.
+
+class TileCoordinator {
+public:
+    // fills floats_per_pixel floats for every pixel of the tile
+    typedef function<void(const TileScheduler::Tile &, float *)> TraceFunction;
+
+    typedef function<void(const TileScheduler::Tile &, const float *)> ResultFunction;
+
+    TileCoordinator(int _width, int _height, int _floats_per_pixel, uint64_t _settings, int _tile_size = 32) :
+            width(_width), height(_height), floats_per_pixel(_floats_per_pixel), settings(_settings),
+            tile_size(_tile_size) {}
+
+    // address is port or host:port, an empty host listens on every
+    // interface; NULL picks a free loopback port for the local workers.
+    // result is called on the calling thread, once for every tile
+    void run(const char *address, int num_local_workers, int num_threads, const TraceFunction &trace,
+             const ResultFunction &result);
+
+    // the worker side: connects to host:port and traces tiles until the
+    // coordinator is done with it
+    static void work(const char *address, int floats_per_pixel, uint64_t settings, const TraceFunction &trace);
+
+private:
+    int width;
+    int height;
+    int floats_per_pixel;
+    uint64_t settings;
+    int tile_size;
+};
+
+#endif //RAYTRACER_TILECOORDINATOR_H
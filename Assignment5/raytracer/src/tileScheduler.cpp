@@ -0,0 +1,59 @@
+#include "tileScheduler.h"
+#include <thread>
+
+void TileScheduler::run(int num_threads, const TileFunction &tileFunction) {
+    if (num_threads < 1) num_threads = 1;
+
+    // deal the tiles out round-robin, so that every worker starts
+    // with a spread of cheap and expensive parts of the image
+    queues = vector<WorkQueue>(num_threads);
+    int count = 0;
+    for (int y = 0; y < height; y += tile_size) {
+        for (int x = 0; x < width; x += tile_size) {
+            Tile tile = {x, y, min(x + tile_size, width), min(y + tile_size, height)};
+            queues[count % num_threads].tiles.push_back(tile);
+            count++;
+        }
+    }
+
+    vector<thread> threads;
+    for (int i = 1; i < num_threads; i++) {
+        threads.emplace_back(&TileScheduler::worker, this, i, cref(tileFunction));
+    }
+    worker(0, tileFunction);
+    for (thread &t: threads) {
+        t.join();
+    }
+    queues.clear();
+}
+
+void TileScheduler::worker(int id, const TileFunction &tileFunction) {
+    Tile tile;
+    while (popTile(id, tile) || stealTile(id, tile)) {
+        tileFunction(tile);
+    }
+}
+
+bool TileScheduler::popTile(int id, Tile &tile) {
+    WorkQueue &queue = queues[id];
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.tiles.empty()) return false;
+    tile = queue.tiles.front();
+    queue.tiles.pop_front();
+    return true;
+}
+
+bool TileScheduler::stealTile(int id, Tile &tile) {
+    // nothing is ever added once the workers are running, so a single
+    // sweep over the other queues finding them all empty means we are done
+    int n = queues.size();
+    for (int i = 1; i < n; i++) {
+        WorkQueue &victim = queues[(id + i) % n];
+        lock_guard<mutex> guard(victim.lock);
+        if (victim.tiles.empty()) continue;
+        tile = victim.tiles.back();
+        victim.tiles.pop_back();
+        return true;
+    }
+    return false;
+}
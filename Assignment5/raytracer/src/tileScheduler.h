@@ -0,0 +1,53 @@
+#ifndef RAYTRACER_TILESCHEDULER_H
+#define RAYTRACER_TILESCHEDULER_H
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// ====================================================================
+// ====================================================================
+// Splits the image into small tiles (16x16 pixels by default, so the
+// rays of one tile touch roughly the same part of the scene) and hands
+// them to a pool of worker threads.  Every worker owns a queue of tiles;
+// it pops from the front of its own queue and, once that runs dry,
+// steals from the back of the other workers' queues.
+
+class TileScheduler {
+public:
+    struct Tile {
+        int x0, y0;
+        int x1, y1;
+    };
+
+    typedef function<void(const Tile &)> TileFunction;
+
+    TileScheduler(int _width, int _height, int _tile_size = 16) :
+            width(_width), height(_height), tile_size(_tile_size) {}
+
+    // calls tileFunction once for every tile, from num_threads threads
+    // (the calling thread is one of them); returns when all tiles are done
+    void run(int num_threads, const TileFunction &tileFunction);
+
+private:
+    struct WorkQueue {
+        mutex lock;
+        deque<Tile> tiles;
+    };
+
+    void worker(int id, const TileFunction &tileFunction);
+
+    bool popTile(int id, Tile &tile);
+
+    bool stealTile(int id, Tile &tile);
+
+    int width;
+    int height;
+    int tile_size;
+    vector<WorkQueue> queues;
+};
+
+#endif //RAYTRACER_TILESCHEDULER_H